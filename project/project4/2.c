@@ -10,6 +10,10 @@
 #include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <stdint.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 //size of a disk block
 #define	BLOCK_SIZE 512
@@ -23,15 +27,31 @@
 #define NODE_POINTERS (BLOCK_SIZE - sizeof(int) - sizeof(long)) / sizeof(long)
 #define END_OF_BITMAP (5 * BLOCK_SIZE - 1)
 
+#define BITMAP_BLOCKS 5
+#define BITMAP_WORDS (BITMAP_BLOCKS * BLOCK_SIZE / 8)
+#define WORDS_PER_BITMAP_BLOCK (BLOCK_SIZE / 8)
+#define SUMMARY_WORDS ((BITMAP_WORDS + 63) / 64)
+
 //////////////////////////////////////////////////////////////////////////
 /////////////////////////// SECTION COMPLETE /////////////////////////////
 //////////////////////////////////////////////////////////////////////////
 
+//The bitmap in the last 5 blocks of .disk has a 1 bit for every block in use,
+//lowest bit first.  It is read once and kept here for the rest of the mount so
+//an allocation is a scan in memory and a write of the one block it changed.
+
 struct cs1550_bitmap {
 
-	unsigned char bitmap[5 * BLOCK_SIZE];
+	uint64_t words[BITMAP_WORDS];		//the bitmap as it is on disk
+	uint64_t full[SUMMARY_WORDS];		//a 1 bit for every word above with no free blocks
+	unsigned char dirty[BITMAP_BLOCKS];	//bitmap blocks changed since they were written
+	long offset;						//where the bitmap starts in .disk
+	long blocks;						//blocks the bitmap can hand out
+	int loaded;
 };
 
+static struct cs1550_bitmap bitmap;
+
 //////////////////////////////////////////////////////////////////////////
 /////////////////////////// SECTION COMPLETE /////////////////////////////
 //////////////////////////////////////////////////////////////////////////
@@ -174,33 +194,117 @@ int write(FILE *file, cs1550_directory_entry entry, long location, char filename
 /////////////////////////// SECTION COMPLETE /////////////////////////////
 //////////////////////////////////////////////////////////////////////////
 
-static int retrieve_block(FILE *file) {
+static void bitmap_summarize(long word) {
 
-	struct cs1550_bitmap bitmap;
+	if (bitmap.words[word] == UINT64_MAX) {
+		bitmap.full[word / 64] |= (uint64_t) 1 << (word % 64);
+	}
 
-	if (fread(&bitmap, 1, BLOCK_SIZE * 5, file) == (END_OF_BITMAP + 1)) {
+	else {
+		bitmap.full[word / 64] &= ~((uint64_t) 1 << (word % 64));
+	}
+}
 
-		int index;
-		int x;
+//////////////////////////////////////////////////////////////////////////
+/////////////////////////// SECTION COMPLETE /////////////////////////////
+//////////////////////////////////////////////////////////////////////////
 
-		for (index = 1; index < END_OF_BITMAP; index++) {
+static int bitmap_load(FILE *file) {
 
-			if (bitmap.bitmap[index] < 255) {
+	long word;
 
-				unsigned char bits = 128;
-				unsigned char mark = bitmap.bitmap[index] + 1;
+	if (bitmap.loaded) {
+		return 0;
+	}
 
-				for (x = 7; (bits ^ mark) != 0; bits >>= 1, x--);
+	if (fseek(file, -BLOCK_SIZE * BITMAP_BLOCKS, SEEK_END) != 0) {
+		return -1;
+	}
 
-				x += (index * 8);
-				bitmap.bitmap[index] = bitmap.bitmap[index] | mark;
+	bitmap.offset = ftell(file);
 
-				break;
-			}
+	if (fread(bitmap.words, 1, sizeof(bitmap.words), file) != sizeof(bitmap.words)) {
+		return -1;
+	}
+
+	//The last byte of the bitmap has never been handed out, and neither has
+	//anything past the blocks the disk actually has.
+	bitmap.blocks = END_OF_BITMAP * 8;
+
+	if (bitmap.offset / BLOCK_SIZE < bitmap.blocks) {
+		bitmap.blocks = bitmap.offset / BLOCK_SIZE;
+	}
+
+	memset(bitmap.full, 0, sizeof(bitmap.full));
+	memset(bitmap.dirty, 0, sizeof(bitmap.dirty));
+
+#ifdef __SSE2__
+	//Compare two words at a time against all ones; on a well used disk most
+	//pairs come back full and never need the scalar test.
+	for (word = 0; word + 1 < BITMAP_WORDS; word += 2) {
+
+		__m128i pair = _mm_loadu_si128((const __m128i *) &bitmap.words[word]);
+		int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(pair, _mm_set1_epi8(-1)));
+
+		if (mask == 0xffff) {
+			bitmap.full[word / 64] |= (uint64_t) 3 << (word % 64);
+		}
+
+		else if (mask) {
+			bitmap_summarize(word);
+			bitmap_summarize(word + 1);
 		}
+	}
+
+	for (; word < BITMAP_WORDS; word++) {
+		bitmap_summarize(word);
+	}
+#else
+	for (word = 0; word < BITMAP_WORDS; word++) {
+		bitmap_summarize(word);
+	}
+#endif
 
-		if (fwrite(bitmap.bitmap, 1, BLOCK_SIZE * 5, file) == END_OF_BITMAP + 1) {
-			return x;
+	bitmap.loaded = 1;
+	return 0;
+}
+
+//////////////////////////////////////////////////////////////////////////
+/////////////////////////// SECTION COMPLETE /////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+static long bitmap_find(void) {
+
+	long summary;
+
+	for (summary = 0; summary < SUMMARY_WORDS; summary++) {
+
+		uint64_t open = ~bitmap.full[summary];
+
+		while (open) {
+
+			long word = summary * 64 + __builtin_ctzll(open);
+			uint64_t free;
+
+			if (word >= BITMAP_WORDS) {
+				return -1;
+			}
+
+			free = ~bitmap.words[word];
+
+			//the first byte has never been handed out; block 0 is the root
+			if (word == 0) {
+				free &= ~(uint64_t) 0xff;
+			}
+
+			if (free) {
+
+				long block = word * 64 + __builtin_ctzll(free);
+
+				return block < bitmap.blocks ? block : -1;
+			}
+
+			open &= open - 1;
 		}
 	}
 
@@ -211,6 +315,83 @@ static int retrieve_block(FILE *file) {
 /////////////////////////// SECTION COMPLETE /////////////////////////////
 //////////////////////////////////////////////////////////////////////////
 
+static void bitmap_mark(long block, int used) {
+
+	long word = block / 64;
+	uint64_t bit = (uint64_t) 1 << (block % 64);
+
+	if (used) {
+		bitmap.words[word] |= bit;
+	}
+
+	else {
+		bitmap.words[word] &= ~bit;
+	}
+
+	bitmap_summarize(word);
+	bitmap.dirty[word / WORDS_PER_BITMAP_BLOCK] = 1;
+}
+
+//////////////////////////////////////////////////////////////////////////
+/////////////////////////// SECTION COMPLETE /////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+static int bitmap_flush(FILE *file) {
+
+	int index;
+
+	for (index = 0; index < BITMAP_BLOCKS; index++) {
+
+		if (bitmap.dirty[index]) {
+
+			if (fseek(file, bitmap.offset + index * BLOCK_SIZE, SEEK_SET) != 0) {
+				return -1;
+			}
+
+			if (fwrite(&bitmap.words[index * WORDS_PER_BITMAP_BLOCK], 1, BLOCK_SIZE, file) != BLOCK_SIZE) {
+				return -1;
+			}
+
+			bitmap.dirty[index] = 0;
+		}
+	}
+
+	return 0;
+}
+
+//////////////////////////////////////////////////////////////////////////
+/////////////////////////// SECTION COMPLETE /////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+static int retrieve_block(FILE *file) {
+
+	long block;
+
+	if (bitmap_load(file) != 0) {
+		return -1;
+	}
+
+	block = bitmap_find();
+
+	if (block < 0) {
+		return -1;
+	}
+
+	bitmap_mark(block, 1);
+
+	if (bitmap_flush(file) != 0) {
+		bitmap_mark(block, 0);
+		bitmap.dirty[block / 64 / WORDS_PER_BITMAP_BLOCK] = 0;
+		return -1;
+	}
+
+	return block;
+}
+
+//////////////////////////////////////////////////////////////////////////
+/////////////////////////// SECTION COMPLETE /////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
 int add_node(FILE *file, cs1550_node node, long this_node_location, long next_node_location) {
 
 	if (node.value == 0) {
@@ -467,8 +648,6 @@ static int cs1550_mkdir(const char *path, mode_t mode) {
 	int index, directories;
 	long start;
 
-	struct cs1550_bitmap bit_map;
-
 	cs1550_root_directory root;
 	cs1550_directory_entry entry;
 
@@ -476,9 +655,6 @@ static int cs1550_mkdir(const char *path, mode_t mode) {
 	char directory[MAX_FILENAME + 1];
 	char filename[MAX_FILENAME + 1];
 
-	unsigned char x = 128;
-	unsigned char map;
-
 	memset(extension, 0, MAX_EXTENSION + 1);
 	memset(directory, 0, MAX_FILENAME + 1);
 	memset(filename, 0, MAX_FILENAME + 1);
@@ -510,47 +686,24 @@ static int cs1550_mkdir(const char *path, mode_t mode) {
 			}
 		}
 
-		if (!fseek(file, -BLOCK_SIZE * 5, SEEK_END)) {
+		start = retrieve_block(file);
 
-			fread(&bit_map, 1, BLOCK_SIZE * 5, file);
+		if (start > 0) {
 
-			start = 0;
+			fseek(file, 0, SEEK_SET);
+			fread(&root, 1, BLOCK_SIZE, file);
 
-			for (index = 1; index < END_OF_BITMAP; index++) {
+			root.directories[root.nDirectories].nStartBlock = start;
 
-				if (bit_map.bitmap[index] < 255) {
+			strcpy(root.directories[root.nDirectories].dname, directory);
 
-					map = bit_map.bitmap[index] + 1;
+			root.nDirectories++;
 
-					for (start = 7; (map^x) != 0; x>>=1, start--);
+			fseek(file, 0, SEEK_SET);
+			fwrite(&root, 1, BLOCK_SIZE, file);
 
-					start += (index * 8);
-
-					bit_map.bitmap[index] = bit_map.bitmap[index] | map;
-
-					fwrite(&bit_map, 1, BLOCK_SIZE * 5, file);
-
-					break;
-				}
-			}
-
-			if (start != 0) {
-
-				fseek(file, 0, SEEK_SET);
-				fread(&root, 1, BLOCK_SIZE, file);
-
-				root.directories[root.nDirectories].nStartBlock = start;
-
-				strcpy(root.directories[root.nDirectories].dname, directory);
-
-				root.nDirectories++;
-
-				fseek(file, 0, SEEK_SET);
-				fwrite(&root, 1, BLOCK_SIZE, file);
-
-				fseek(file, start * BLOCK_SIZE, SEEK_SET);
-				fwrite(&entry, 1, BLOCK_SIZE, file);
-			}
+			fseek(file, start * BLOCK_SIZE, SEEK_SET);
+			fwrite(&entry, 1, BLOCK_SIZE, file);
 		}
 	}
 
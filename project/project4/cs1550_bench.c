@@ -0,0 +1,990 @@
+/*
+	cs1550_bench: time the cs1550 driver on a few fixed workloads.
+
+	gcc -Wall -O2 -o cs1550_bench cs1550_bench.c `pkg-config fuse --cflags --libs` -lpthread
+	./cs1550_bench [-s size] [-n count] [-o options] benchmark...
+
+	Like cs1550_stress, the driver is compiled in and its operations are called
+	directly, on a fresh image in a scratch directory.  The numbers are the
+	driver's own, without the kernel round trip, so they show what a change to
+	the driver does to the work it has to do.  Each benchmark formats its own
+	image of -s MB (64 if not given); -n scales it and -o is passed on to the
+	driver.  The driver's unmount statistics go to stderr as usual.
+
+	stat	getattr calls per second over -n files (1000), answered from the
+		attribute cache and with the cache emptied before every call.  The
+		cache is made big enough for them all (-o attr_cache) when the
+		default isn't.  attr_timeout and entry_timeout act in the kernel and
+		need a real mount to measure.
+
+	alloc	The same create, append, read and unlink workload on -n files (300)
+		under each allocator (-o alloc=extent, bitmap and fat): appends go
+		round-robin, a third of the files are deleted halfway and the rest
+		keep growing.  Reports each phase's rate, runs per file once they are
+		written and what the device transferred, against the data's own size.
+
+	fsync	8 threads each make -n small files (200) and fsync every one, without
+		the journal and with it, where fsyncs that arrive together share one
+		commit.  What an fdatasync costs depends on what the scratch directory
+		is on, so run it on the disk that matters.
+
+	tiny	stat and read -n files (1000) each of 20, 100 and 200 bytes in 8
+		directories, each size from a freshly mounted image.  Files up to
+		INLINE_MAX_SIZE can be kept inline in their directory block, when it
+		has room.  Reports how many were, the rate, and the block cache
+		lookups and blocks read from .disk per file.
+
+	bigdir	Grow one directory to -n files (100000).  At 1000 files and every ten
+		times that, reports the rate of the mknods since the last report, and
+		of getattrs of random names in it past the attribute cache.
+
+	verify	Write -n MB (32) in 16 files, then read them all back from a fresh
+		mount, with every block checked against its checksum and with the
+		check skipped.  Reports the best of 3 of each.
+
+	compress	Write -n MB (8) of generated log lines in 8 files, read them
+		back from a fresh mount and delete them, with and without
+		-o compress, and then the same with random bytes.  Reports the
+		blocks the files took (as a share of their size), the read rate and
+		the blocks read from .disk.
+
+	readers	Write -n MB (32) in 16 files, then read 100-byte pieces at random
+		offsets of them with 1, 2, 4 and 8 threads, through a block cache
+		of 64 blocks so nearly every read misses and goes to .disk.  Each
+		thread count makes the same number of reads, split between the
+		threads, starting with .disk out of the page cache, and then
+		again with it in.  Reports reads per second and cache misses per
+		read.  Cold reads wait for the device, and the threads' waits
+		overlap even on one core; warm ones only overlap on more cores.
+*/
+
+#define main cs1550_main
+#include "cs1550_1.c"
+#undef main
+
+//What main() handed to fuse_main: the operations and the mount
+static const struct fuse_operations* ops;
+static struct fuse_context context;
+
+struct fuse_context* fuse_get_context(void){
+	return &context;
+}
+
+int fuse_main_real(int argc, char* argv[], const struct fuse_operations* op, size_t op_size, void* user_data){
+	(void) argc;
+	(void) argv;
+	(void) op_size;
+	ops = op;
+	context.private_data = user_data;
+	return 0;
+}
+
+//Image size in MB and the options every mount gets
+static long long image_mb = 64;
+static const char* mount_options = "";
+
+//A blank .disk, which the driver formats when it mounts it
+static int bench_image(void){
+	int fd = open(".disk", O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if(fd < 0 || ftruncate(fd, image_mb * 1024 * 1024) != 0){
+		perror("cs1550_bench: .disk");
+		return -1;
+	}
+	close(fd);
+	return 0;
+}
+
+//Mount .disk with the -o options plus extra ones (which may be "")
+static cs1550_superblock* bench_mount(const char* extra){
+	char options[256];
+	snprintf(options, sizeof(options), "%s%s%s", mount_options, (mount_options[0] && extra[0]) ? "," : "", extra);
+	char* args[] = { "cs1550", "mnt", "-o", options, NULL };
+	int argc = options[0] ? 4 : 2;
+	context.private_data = NULL;
+	if(cs1550_main(argc, args) != 0 || context.private_data == NULL){
+		fprintf(stderr, "cs1550_bench: mount failed\n");
+		return NULL;
+	}
+	return context.private_data;
+}
+
+static void bench_unmount(void){
+	ops->destroy(context.private_data);
+	context.private_data = NULL;
+}
+
+static double now(void){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+//Create path holding len bytes of data (none if data is NULL)
+static int bench_create(const char* path, const char* data, size_t len){
+	struct fuse_file_info fi;
+	memset(&fi, 0, sizeof(struct fuse_file_info));
+	int res = ops->mknod(path, S_IFREG | 0644, 0);
+	if(res == 0 && data != NULL){
+		res = ops->open(path, &fi);
+		if(res == 0){
+			if(ops->write(path, data, len, 0, &fi) != (int) len){
+				res = -EIO;
+			}
+			int flushed = ops->flush(path, &fi);
+			ops->release(path, &fi);
+			res = res ? res : flushed;
+		}
+	}
+	if(res != 0){
+		fprintf(stderr, "cs1550_bench: can't create %s (%d)\n", path, res);
+	}
+	return res;
+}
+
+//Name of file i, dealt out over ndirs directories
+static void bench_path(char* path, size_t size, long i, int ndirs){
+	snprintf(path, size, "/d%ld/f%ld.dat", i % ndirs, i / ndirs);
+}
+
+//Make directories /d0 to /d(ndirs - 1)
+static void bench_dirs(int ndirs){
+	char path[32];
+	int d = 0;
+	for(d = 0; d < ndirs; d++){
+		snprintf(path, sizeof(path), "/d%d", d);
+		ops->mkdir(path, 0755);
+	}
+}
+
+//Directories the stat benchmark's files are dealt out over
+#define STAT_DIRS 10
+
+//getattr over every file, round after round for about a second; returns calls
+//per second.  Without the cache each file's answer is dropped just before.
+static double stat_rate(cs1550_superblock* sb, long count, int cached){
+	char path[64];
+	struct stat st;
+	long calls = 0;
+	double start = now();
+	double elapsed = 0;
+	while(elapsed < 1.0){
+		long i = 0;
+		for(i = 0; i < count; i++){
+			bench_path(path, sizeof(path), i, STAT_DIRS);
+			if(!cached){
+				attr_cache_forget_path(sb, path);
+			}
+			if(ops->getattr(path, &st) != 0){
+				fprintf(stderr, "cs1550_bench: getattr %s failed\n", path);
+				return 0;
+			}
+		}
+		calls += count;
+		elapsed = now() - start;
+	}
+	return calls / elapsed;
+}
+
+static int bench_stat(long count){
+	cs1550_superblock* sb = NULL;
+	char path[64];
+	char extra[32] = "";
+	long i = 0;
+	if(count <= 0){
+		count = 1000;
+	}
+	if(count > DEFAULT_ATTR_CACHE){
+		snprintf(extra, sizeof(extra), "attr_cache=%ld", count);
+	}
+	if(bench_image() != 0 || (sb = bench_mount(extra)) == NULL){
+		return 1;
+	}
+	bench_dirs(STAT_DIRS);
+	for(i = 0; i < count; i++){
+		bench_path(path, sizeof(path), i, STAT_DIRS);
+		if(bench_create(path, "x", 1) != 0){
+			return 1;
+		}
+	}
+
+	double uncached = stat_rate(sb, count, 0);
+	unsigned long hits = sb->attrs.hits;
+	unsigned long misses = sb->attrs.misses;
+	double cached = stat_rate(sb, count, 1);
+	hits = sb->attrs.hits - hits;
+	misses = sb->attrs.misses - misses;
+	printf("stat: %ld files, %.0f getattr/s without the attribute cache, %.0f/s with it (%.1fx, %.0f%% hits)\n",
+		count, uncached, cached, cached / uncached, 100.0 * hits / (hits + misses));
+	bench_unmount();
+	return 0;
+}
+
+//Transfers the block device has made, for telling what a stretch of work cost
+struct dev_counts {
+	unsigned long submissions;
+	unsigned long blocks_read;
+	unsigned long blocks_written;
+};
+
+//Add what the device did since start to total; start is then brought up to date
+static void dev_count(cs1550_superblock* sb, struct dev_counts* start, struct dev_counts* total){
+	total->submissions += sb->dev.submissions - start->submissions;
+	total->blocks_read += sb->dev.blocks_read - start->blocks_read;
+	total->blocks_written += sb->dev.blocks_written - start->blocks_written;
+	start->submissions = sb->dev.submissions;
+	start->blocks_read = sb->dev.blocks_read;
+	start->blocks_written = sb->dev.blocks_written;
+}
+
+//Write len bytes at offset in path
+static int bench_write(const char* path, const char* data, size_t len, off_t offset){
+	struct fuse_file_info fi;
+	memset(&fi, 0, sizeof(struct fuse_file_info));
+	int res = ops->open(path, &fi);
+	if(res == 0){
+		if(ops->write(path, data, len, offset, &fi) != (int) len){
+			res = -EIO;
+		}
+		int flushed = ops->flush(path, &fi);
+		ops->release(path, &fi);
+		res = res ? res : flushed;
+	}
+	if(res != 0){
+		fprintf(stderr, "cs1550_bench: can't write %s (%d)\n", path, res);
+	}
+	return res;
+}
+
+//Read all size bytes of path
+static int bench_read(const char* path, char* buf, size_t size){
+	struct fuse_file_info fi;
+	memset(&fi, 0, sizeof(struct fuse_file_info));
+	int res = ops->open(path, &fi);
+	if(res == 0){
+		size_t done = 0;
+		while(res == 0 && done < size){
+			int got = ops->read(path, buf + done, size - done < 65536 ? size - done : 65536, done, &fi);
+			res = (got > 0) ? 0 : -EIO;
+			done += (got > 0) ? got : 0;
+		}
+		ops->release(path, &fi);
+	}
+	if(res != 0){
+		fprintf(stderr, "cs1550_bench: can't read %s (%d)\n", path, res);
+	}
+	return res;
+}
+
+//Runs of contiguous blocks path is stored in (0 if it has no blocks of its own)
+static long bench_runs(const char* path){
+	struct fuse_file_info fi;
+	memset(&fi, 0, sizeof(struct fuse_file_info));
+	if(ops->open(path, &fi) != 0){
+		return 0;
+	}
+	cs1550_open_file* of = ((cs1550_handle*) (uintptr_t) fi.fh)->of;
+	long runs = 0;
+	long i = 0;
+	for(i = 0; i < of->nblocks; i++){
+		if(of->blocks[i] > 0 && (i == 0 || of->blocks[i] != of->blocks[i - 1] + 1)){ //Not a hole or packed
+			runs++;
+		}
+	}
+	ops->release(path, &fi);
+	return runs;
+}
+
+//Files the alloc benchmark keeps in each directory, and rounds of appends
+#define ALLOC_DIRS 10
+#define ALLOC_ROUNDS 8
+#define ALLOC_MAX_APPEND (16 * 1024)
+
+//Append a random 1 byte to 16 KB to every file in use, round after round
+static int alloc_append(long count, const int* live, size_t* sizes, const char* data, unsigned int* seed, size_t* appended){
+	char path[64];
+	int round = 0;
+	long i = 0;
+	for(round = 0; round < ALLOC_ROUNDS; round++){
+		for(i = 0; i < count; i++){
+			if(!live[i]){
+				continue;
+			}
+			size_t len = 1 + rand_r(seed) % ALLOC_MAX_APPEND;
+			bench_path(path, sizeof(path), i, ALLOC_DIRS);
+			if(bench_write(path, data, len, sizes[i]) != 0){
+				return -1;
+			}
+			sizes[i] += len;
+			*appended += len;
+		}
+	}
+	return 0;
+}
+
+//The same create/append/read/unlink workload on one allocator
+static int alloc_workload(const char* alloc, long count){
+	char extra[64];
+	char path[64];
+	snprintf(extra, sizeof(extra), "alloc=%s", alloc);
+	cs1550_superblock* sb = NULL;
+	if(bench_image() != 0 || (sb = bench_mount(extra)) == NULL){
+		return 1;
+	}
+	int* live = calloc(count, sizeof(int));
+	size_t* sizes = calloc(count, sizeof(size_t));
+	char* data = malloc(ALLOC_MAX_APPEND * (ALLOC_ROUNDS * 2 + 1));
+	unsigned int seed = 1550; //Every allocator gets the same workload
+	long i = 0;
+	memset(data, 'a', ALLOC_MAX_APPEND * (ALLOC_ROUNDS * 2 + 1));
+
+	struct dev_counts start = { sb->dev.submissions, sb->dev.blocks_read, sb->dev.blocks_written };
+	struct dev_counts total = { 0, 0, 0 };
+	bench_dirs(ALLOC_DIRS);
+	double t = now();
+	for(i = 0; i < count; i++){
+		bench_path(path, sizeof(path), i, ALLOC_DIRS);
+		if(bench_create(path, NULL, 0) != 0){
+			return 1;
+		}
+		live[i] = 1;
+	}
+	double create_time = now() - t;
+
+	//Interleaved appends, then a third of the files go and the rest grow into the gaps
+	size_t appended = 0;
+	t = now();
+	if(alloc_append(count, live, sizes, data, &seed, &appended) != 0){
+		return 1;
+	}
+	for(i = 0; i < count; i += 3){
+		bench_path(path, sizeof(path), i, ALLOC_DIRS);
+		ops->unlink(path);
+		live[i] = 0;
+	}
+	if(alloc_append(count, live, sizes, data, &seed, &appended) != 0 || cache_flush(sb) != 0){
+		return 1;
+	}
+	double append_time = now() - t;
+	long runs = 0;
+	long files = 0;
+	for(i = 0; i < count; i++){
+		if(live[i]){
+			bench_path(path, sizeof(path), i, ALLOC_DIRS);
+			runs += bench_runs(path);
+			files++;
+		}
+	}
+	dev_count(sb, &start, &total);
+
+	//Read everything back from a fresh mount
+	bench_unmount();
+	if((sb = bench_mount(extra)) == NULL){
+		return 1;
+	}
+	start.submissions = sb->dev.submissions;
+	start.blocks_read = sb->dev.blocks_read;
+	start.blocks_written = sb->dev.blocks_written;
+	size_t bytes_read = 0;
+	t = now();
+	for(i = 0; i < count; i++){
+		if(live[i]){
+			bench_path(path, sizeof(path), i, ALLOC_DIRS);
+			if(bench_read(path, data, sizes[i]) != 0){
+				return 1;
+			}
+			bytes_read += sizes[i];
+		}
+	}
+	double read_time = now() - t;
+	t = now();
+	for(i = 0; i < count; i++){
+		if(live[i]){
+			bench_path(path, sizeof(path), i, ALLOC_DIRS);
+			ops->unlink(path);
+		}
+	}
+	if(cache_flush(sb) != 0){
+		return 1;
+	}
+	double unlink_time = now() - t;
+	dev_count(sb, &start, &total);
+
+	printf("alloc: %-6s create %7.0f/s  append %6.1f MB/s  read %6.1f MB/s  unlink %7.0f/s  %5.2f runs/file  %lu submissions, %lu blocks read, %lu written (%lu of them data)\n",
+		alloc, count / create_time, appended / append_time / 1e6, bytes_read / read_time / 1e6, files / unlink_time,
+		(double) runs / files, total.submissions, total.blocks_read, total.blocks_written, (unsigned long) (appended / BLOCK_SIZE));
+	bench_unmount();
+	free(live);
+	free(sizes);
+	free(data);
+	return 0;
+}
+
+static int bench_alloc(long count){
+	if(count <= 0){
+		count = 300;
+	}
+	return alloc_workload("extent", count) || alloc_workload("bitmap", count) || alloc_workload("fat", count);
+}
+
+//Threads the fsync benchmark runs
+#define FSYNC_THREADS 8
+
+struct fsync_worker {
+	pthread_t thread;
+	int id;
+	long count;
+	int failed;
+};
+
+//Make count small files, fsyncing each one before closing it
+static void* fsync_worker_run(void* arg){
+	struct fsync_worker* w = arg;
+	char path[64];
+	char data[100];
+	long i = 0;
+	memset(data, 'f', sizeof(data));
+	for(i = 0; i < w->count && !w->failed; i++){
+		struct fuse_file_info fi;
+		memset(&fi, 0, sizeof(struct fuse_file_info));
+		snprintf(path, sizeof(path), "/d%d/f%ld.dat", w->id, i);
+		w->failed = ops->mknod(path, S_IFREG | 0644, 0) != 0 || ops->open(path, &fi) != 0;
+		if(!w->failed){
+			w->failed = ops->write(path, data, sizeof(data), 0, &fi) != sizeof(data) || ops->fsync(path, 1, &fi) != 0;
+			ops->release(path, &fi);
+		}
+	}
+	if(w->failed){
+		fprintf(stderr, "cs1550_bench: can't make and fsync %s\n", path);
+	}
+	return NULL;
+}
+
+static int fsync_workload(const char* extra, long count){
+	cs1550_superblock* sb = NULL;
+	struct fsync_worker workers[FSYNC_THREADS];
+	int t = 0;
+	int failed = 0;
+	if(bench_image() != 0 || (sb = bench_mount(extra)) == NULL){
+		return 1;
+	}
+	bench_dirs(FSYNC_THREADS);
+	unsigned long commits = sb->journal.commits;
+	double start = now();
+	for(t = 0; t < FSYNC_THREADS; t++){
+		workers[t].id = t;
+		workers[t].count = count;
+		workers[t].failed = 0;
+		pthread_create(&workers[t].thread, NULL, fsync_worker_run, &workers[t]);
+	}
+	for(t = 0; t < FSYNC_THREADS; t++){
+		pthread_join(workers[t].thread, NULL);
+		failed |= workers[t].failed;
+	}
+	double elapsed = now() - start;
+	if(sb->journal.enabled){
+		printf("fsync: journal     %7.0f files/s, %lu commits for %ld fsyncs\n", FSYNC_THREADS * count / elapsed,
+			sb->journal.commits - commits, FSYNC_THREADS * count);
+	} else{
+		printf("fsync: no journal  %7.0f files/s, %ld fsyncs that each flush the cache and sync .disk\n", FSYNC_THREADS * count / elapsed,
+			FSYNC_THREADS * count);
+	}
+	bench_unmount();
+	return failed;
+}
+
+static int bench_fsync(long count){
+	if(count <= 0){
+		count = 200;
+	}
+	return fsync_workload("", count) || fsync_workload("journal", count);
+}
+
+//Sizes of file the tiny benchmark makes, and directories each size is dealt out over
+#define TINY_SIZES 3
+#define TINY_DIRS 8
+
+//Name of the tiny benchmark's file i of size bytes
+static void tiny_path(char* path, size_t len, size_t size, long i){
+	snprintf(path, len, "/s%zu.%ld/f%ld.dat", size, i % TINY_DIRS, i / TINY_DIRS);
+}
+
+//stat and read count files of size bytes on a mount that hasn't touched them yet
+static int tiny_pass(cs1550_superblock* sb, size_t size, long count){
+	char path[64];
+	char buf[BLOCK_SIZE];
+	struct stat st;
+	long i = 0;
+	long inline_files = 0;
+	unsigned long lookups = sb->cache.hits + sb->cache.misses;
+	unsigned long blocks_read = sb->dev.blocks_read;
+	double start = now();
+	for(i = 0; i < count; i++){
+		tiny_path(path, sizeof(path), size, i);
+		if(ops->getattr(path, &st) != 0 || (size_t) st.st_size != size || bench_read(path, buf, size) != 0){
+			fprintf(stderr, "cs1550_bench: can't stat and read %s\n", path);
+			return 1;
+		}
+	}
+	double elapsed = now() - start;
+	for(i = 0; i < count; i++){ //Counted afterwards, so the opens don't warm the cache
+		struct fuse_file_info fi;
+		memset(&fi, 0, sizeof(struct fuse_file_info));
+		tiny_path(path, sizeof(path), size, i);
+		if(ops->open(path, &fi) == 0){
+			inline_files += ((cs1550_handle*) (uintptr_t) fi.fh)->of->idata != NULL;
+			ops->release(path, &fi);
+		}
+	}
+	printf("tiny: %3zu-byte files  %3ld%% inline  %7.0f stat+read/s  %.2f block cache lookups and %.2f blocks read from .disk per file\n", size,
+		100 * inline_files / count, count / elapsed, (double) (sb->cache.hits + sb->cache.misses - lookups) / count,
+		(double) (sb->dev.blocks_read - blocks_read) / count);
+	return 0;
+}
+
+static int bench_tiny(long count){
+	//Sizes that can go inline in their directory block, and one that can't
+	static const size_t sizes[] = { 20, 100, INLINE_MAX_SIZE + 72 };
+	cs1550_superblock* sb = NULL;
+	char path[64];
+	char data[INLINE_MAX_SIZE + 72];
+	long i = 0;
+	size_t k = 0;
+	if(count <= 0){
+		count = 1000;
+	}
+	memset(data, 't', sizeof(data));
+	if(bench_image() != 0 || (sb = bench_mount("")) == NULL){
+		return 1;
+	}
+	for(k = 0; k < TINY_SIZES; k++){
+		for(i = 0; i < TINY_DIRS; i++){
+			snprintf(path, sizeof(path), "/s%zu.%ld", sizes[k], i);
+			ops->mkdir(path, 0755);
+		}
+		for(i = 0; i < count; i++){
+			tiny_path(path, sizeof(path), sizes[k], i);
+			if(bench_create(path, data, sizes[k]) != 0){
+				return 1;
+			}
+		}
+	}
+	bench_unmount();
+
+	int failed = 0;
+	for(k = 0; k < TINY_SIZES && !failed; k++){ //Each from a cold cache
+		if((sb = bench_mount("")) == NULL){
+			return 1;
+		}
+		failed = tiny_pass(sb, sizes[k], count);
+		bench_unmount();
+	}
+	return failed;
+}
+
+//getattr calls the bigdir benchmark times at each size
+#define BIGDIR_LOOKUPS 10000
+
+static int bench_bigdir(long count){
+	cs1550_superblock* sb = NULL;
+	char path[64];
+	struct stat st;
+	unsigned int seed = 1550;
+	long made = 0;
+	long target = 0;
+	long i = 0;
+	if(count <= 0){
+		count = 100000;
+	}
+	if(bench_image() != 0 || (sb = bench_mount("")) == NULL){
+		return 1;
+	}
+	ops->mkdir("/big", 0755);
+	for(target = 1000; made < count; target *= 10){
+		if(target > count){
+			target = count;
+		}
+		long before = made;
+		double start = now();
+		for(; made < target; made++){
+			snprintf(path, sizeof(path), "/big/f%ld.dat", made);
+			if(ops->mknod(path, S_IFREG | 0644, 0) != 0){
+				fprintf(stderr, "cs1550_bench: can't create %s\n", path);
+				return 1;
+			}
+		}
+		double mknod_time = now() - start;
+
+		//Lookups of names all over the directory, none of them in the attribute cache
+		unsigned long lookups = sb->cache.hits + sb->cache.misses;
+		start = now();
+		for(i = 0; i < BIGDIR_LOOKUPS; i++){
+			snprintf(path, sizeof(path), "/big/f%ld.dat", rand_r(&seed) % made);
+			attr_cache_forget_path(sb, path);
+			if(ops->getattr(path, &st) != 0){
+				fprintf(stderr, "cs1550_bench: getattr %s failed\n", path);
+				return 1;
+			}
+		}
+		double getattr_time = now() - start;
+		printf("bigdir: %7ld entries  mknod %7.0f/s  getattr %7.0f/s  %.2f block cache lookups per getattr\n", made,
+			(made - before) / mknod_time, BIGDIR_LOOKUPS / getattr_time, (double) (sb->cache.hits + sb->cache.misses - lookups) / BIGDIR_LOOKUPS);
+	}
+	bench_unmount();
+	return 0;
+}
+
+//Files the verify benchmark reads, and passes of each kind it takes the best of
+#define VERIFY_FILES 16
+#define VERIFY_PASSES 3
+
+//Read every file from a fresh mount, checking blocks against their checksums
+//or not; returns MB/s
+static double verify_pass(size_t size, char* buf, int verify){
+	char path[64];
+	int i = 0;
+	cs1550_superblock* sb = bench_mount("");
+	if(sb == NULL){
+		return 0;
+	}
+	uint32_t* table = sb->dev.csum.table;
+	if(!verify){ //Only reads until it goes back, so nothing needs recording
+		sb->dev.csum.table = NULL;
+	}
+	double start = now();
+	for(i = 0; i < VERIFY_FILES; i++){
+		snprintf(path, sizeof(path), "/v/f%d.dat", i);
+		if(bench_read(path, buf, size) != 0){
+			sb->dev.csum.table = table;
+			bench_unmount();
+			return 0;
+		}
+	}
+	double elapsed = now() - start;
+	sb->dev.csum.table = table;
+	bench_unmount();
+	return VERIFY_FILES * size / elapsed / 1e6;
+}
+
+static int bench_verify(long count){
+	char path[64];
+	int i = 0;
+	if(count <= 0){
+		count = 32;
+	}
+	size_t size = count * 1024 * 1024 / VERIFY_FILES;
+	char* buf = malloc(size);
+	for(i = 0; (size_t) i < size; i++){
+		buf[i] = i * 7 + i / 4096;
+	}
+	if(bench_image() != 0 || bench_mount("") == NULL){
+		return 1;
+	}
+	if(((cs1550_superblock*) context.private_data)->dev.csum.table == NULL){
+		fprintf(stderr, "cs1550_bench: the image has no checksum table\n");
+		return 1;
+	}
+	ops->mkdir("/v", 0755);
+	for(i = 0; i < VERIFY_FILES; i++){
+		snprintf(path, sizeof(path), "/v/f%d.dat", i);
+		if(bench_create(path, buf, size) != 0){
+			return 1;
+		}
+	}
+	bench_unmount();
+
+	double with = 0;
+	double without = 0;
+	for(i = 0; i < VERIFY_PASSES; i++){ //Taking turns, so the page cache is as warm for both
+		double rate = verify_pass(size, buf, 0);
+		without = (rate > without) ? rate : without;
+		rate = verify_pass(size, buf, 1);
+		with = (rate > with) ? rate : with;
+	}
+	free(buf);
+	if(with == 0 || without == 0){
+		return 1;
+	}
+	printf("verify: %ld MB  %.0f MB/s without checking checksums  %.0f MB/s checking them (%.1f%% slower, crc32c %s)\n", count, without, with,
+		100 * (without - with) / without, crc32c_kind);
+	return 0;
+}
+
+//Files the compress benchmark writes of each corpus
+#define COMPRESS_FILES 8
+
+//Fill buf with len bytes of log lines, the same every time
+static void compress_log_text(char* buf, size_t len){
+	static const char* levels[] = { "INFO", "INFO", "INFO", "DEBUG", "WARN" };
+	static const char* what[] = { "served from cache", "read from disk", "queued", "retried", "timed out" };
+	unsigned int seed = 1550;
+	size_t pos = 0;
+	long line = 0;
+	char text[160];
+	while(pos < len){
+		int n = snprintf(text, sizeof(text), "2026-10-17 %02ld:%02ld:%02ld.%03u worker-%u %s request %u %s in %u ms\n",
+			(line / 3600000) % 24, (line / 60000) % 60, (line / 1000) % 60, rand_r(&seed) % 1000, rand_r(&seed) % 16,
+			levels[rand_r(&seed) % 5], rand_r(&seed) % 100000, what[rand_r(&seed) % 5], rand_r(&seed) % 500);
+		size_t copy = (len - pos < (size_t) n) ? len - pos : (size_t) n;
+		memcpy(buf + pos, text, copy);
+		pos += copy;
+		line++;
+	}
+}
+
+//Random bytes, which won't compress
+static void compress_random(char* buf, size_t len){
+	unsigned int seed = 1550;
+	size_t i = 0;
+	for(i = 0; i < len; i++){
+		buf[i] = rand_r(&seed);
+	}
+}
+
+//Write the corpus in data, then read it back from a fresh mount
+static int compress_workload(const char* corpus, const char* extra, const char* data, size_t size){
+	char path[64];
+	int i = 0;
+	cs1550_superblock* sb = bench_mount(extra);
+	if(sb == NULL){
+		return 1;
+	}
+	long free_blocks = sb->alloc.free_blocks;
+	ops->mkdir("/c", 0755);
+	for(i = 0; i < COMPRESS_FILES; i++){
+		snprintf(path, sizeof(path), "/c/f%d.dat", i);
+		if(bench_create(path, data + i * size, size) != 0){
+			return 1;
+		}
+	}
+	long used = free_blocks - sb->alloc.free_blocks;
+	bench_unmount();
+
+	char* buf = malloc(size);
+	if((sb = bench_mount(extra)) == NULL){
+		return 1;
+	}
+	unsigned long blocks_read = sb->dev.blocks_read;
+	int failed = 0;
+	double start = now();
+	for(i = 0; i < COMPRESS_FILES && !failed; i++){
+		snprintf(path, sizeof(path), "/c/f%d.dat", i);
+		failed = bench_read(path, buf, size) != 0 || memcmp(buf, data + i * size, size) != 0;
+	}
+	double elapsed = now() - start;
+	blocks_read = sb->dev.blocks_read - blocks_read;
+	for(i = 0; i < COMPRESS_FILES; i++){
+		snprintf(path, sizeof(path), "/c/f%d.dat", i);
+		ops->unlink(path);
+	}
+	ops->rmdir("/c");
+	bench_unmount();
+	free(buf);
+	if(failed){
+		fprintf(stderr, "cs1550_bench: %s didn't read back the way it was written\n", corpus);
+		return 1;
+	}
+	printf("compress: %-6s %-11s %6ld blocks (%3.0f%%)  read %6.1f MB/s, %6lu blocks from .disk\n", corpus, extra[0] ? extra : "plain", used,
+		100.0 * used * BLOCK_SIZE / (COMPRESS_FILES * size), COMPRESS_FILES * size / elapsed / 1e6, blocks_read);
+	return 0;
+}
+
+static int bench_compress(long count){
+	if(count <= 0){
+		count = 8;
+	}
+	size_t size = count * 1024 * 1024 / COMPRESS_FILES;
+	char* data = malloc(COMPRESS_FILES * size);
+	int failed = bench_image() != 0;
+	if(!failed){
+		compress_log_text(data, COMPRESS_FILES * size);
+		failed = compress_workload("log", "", data, size) || compress_workload("log", "compress", data, size);
+	}
+	if(!failed){
+		compress_random(data, COMPRESS_FILES * size);
+		failed = compress_workload("random", "", data, size) || compress_workload("random", "compress", data, size);
+	}
+	free(data);
+	return failed;
+}
+
+//Files the readers benchmark reads, the most threads it runs, the bytes each
+//read asks for and the reads each run makes between its threads
+#define READERS_FILES 16
+#define READERS_MAX_THREADS 8
+#define READERS_PIECE 100
+#define READERS_READS 16000
+
+struct readers_worker {
+	pthread_t thread;
+	unsigned int seed;
+	size_t size;
+	long reads;
+	int failed;
+};
+
+//Read pieces of random files at random offsets, each file opened once
+static void* readers_worker_run(void* arg){
+	struct readers_worker* w = arg;
+	struct fuse_file_info fi[READERS_FILES];
+	char path[64];
+	char buf[READERS_PIECE];
+	int i = 0;
+	for(i = 0; i < READERS_FILES; i++){
+		memset(&fi[i], 0, sizeof(struct fuse_file_info));
+		snprintf(path, sizeof(path), "/r/f%d.dat", i);
+		w->failed |= ops->open(path, &fi[i]) != 0;
+	}
+	long k = 0;
+	for(k = 0; k < w->reads && !w->failed; k++){
+		i = rand_r(&w->seed) % READERS_FILES;
+		off_t offset = ((off_t) rand_r(&w->seed) * RAND_MAX + rand_r(&w->seed)) % (w->size - READERS_PIECE);
+		snprintf(path, sizeof(path), "/r/f%d.dat", i);
+		w->failed = ops->read(path, buf, READERS_PIECE, offset, &fi[i]) != READERS_PIECE;
+	}
+	for(i = 0; i < READERS_FILES; i++){
+		snprintf(path, sizeof(path), "/r/f%d.dat", i);
+		ops->release(path, &fi[i]);
+	}
+	if(w->failed){
+		fprintf(stderr, "cs1550_bench: a random read failed\n");
+	}
+	return NULL;
+}
+
+//Have the kernel drop the pages of .disk it holds, so reads go to the device
+static void bench_drop_pages(void){
+	int fd = open(".disk", O_RDONLY);
+	if(fd >= 0){
+		fdatasync(fd);
+		posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+		close(fd);
+	}
+}
+
+//Run the readers on 1, 2, 4 and 8 threads, from the device if cold
+static int readers_pass(cs1550_superblock* sb, size_t size, int cold){
+	struct readers_worker workers[READERS_MAX_THREADS];
+	int failed = 0;
+	int threads = 0;
+	for(threads = 1; threads <= READERS_MAX_THREADS && !failed; threads *= 2){
+		unsigned long misses = sb->cache.misses;
+		int t = 0;
+		if(cold){
+			bench_drop_pages();
+		}
+		double start = now();
+		for(t = 0; t < threads; t++){
+			workers[t].seed = 1550 + t;
+			workers[t].size = size;
+			workers[t].reads = READERS_READS / threads;
+			workers[t].failed = 0;
+			pthread_create(&workers[t].thread, NULL, readers_worker_run, &workers[t]);
+		}
+		for(t = 0; t < threads; t++){
+			pthread_join(workers[t].thread, NULL);
+			failed |= workers[t].failed;
+		}
+		double elapsed = now() - start;
+		misses = sb->cache.misses - misses;
+		printf("readers: %s %d thread%s %8.0f reads/s, %.2f block cache misses per read\n", cold ? "cold" : "warm", threads,
+			threads > 1 ? "s" : " ", READERS_READS / elapsed, (double) misses / READERS_READS);
+	}
+	return failed;
+}
+
+static int bench_readers(long count){
+	char path[64];
+	int i = 0;
+	if(count <= 0){
+		count = 32;
+	}
+	size_t size = count * 1024 * 1024 / READERS_FILES;
+	char* buf = malloc(size);
+	for(i = 0; (size_t) i < size; i++){
+		buf[i] = i * 13 + i / 512;
+	}
+	if(bench_image() != 0 || bench_mount("") == NULL){
+		return 1;
+	}
+	ops->mkdir("/r", 0755);
+	for(i = 0; i < READERS_FILES; i++){
+		snprintf(path, sizeof(path), "/r/f%d.dat", i);
+		if(bench_create(path, buf, size) != 0){
+			return 1;
+		}
+	}
+	bench_unmount();
+	free(buf);
+
+	cs1550_superblock* sb = bench_mount("cache_blocks=64");
+	if(sb == NULL){
+		return 1;
+	}
+	int failed = readers_pass(sb, size, 1) || readers_pass(sb, size, 0);
+	bench_unmount();
+	return failed;
+}
+
+static const struct benchmark {
+	const char* name;
+	int (*run)(long count);
+} benchmarks[] = {
+	{ "stat", bench_stat },
+	{ "alloc", bench_alloc },
+	{ "fsync", bench_fsync },
+	{ "tiny", bench_tiny },
+	{ "bigdir", bench_bigdir },
+	{ "verify", bench_verify },
+	{ "compress", bench_compress },
+	{ "readers", bench_readers },
+};
+
+#define NBENCHMARKS (sizeof(benchmarks) / sizeof(benchmarks[0]))
+
+int main(int argc, char* argv[]){
+	long count = 0;
+	int opt = 0;
+	int bad = 0;
+	while((opt = getopt(argc, argv, "s:n:o:")) != -1){
+		if(opt == 's'){
+			image_mb = atoll(optarg);
+		} else if(opt == 'n'){
+			count = atol(optarg);
+		} else if(opt == 'o'){
+			mount_options = optarg;
+		} else{
+			bad = 1;
+		}
+	}
+	int i = 0;
+	size_t b = 0;
+	for(i = optind; i < argc && !bad; i++){
+		for(b = 0; b < NBENCHMARKS && strcmp(argv[i], benchmarks[b].name) != 0; b++);
+		bad = (b == NBENCHMARKS);
+	}
+	if(bad || optind == argc || image_mb <= 0){
+		fprintf(stderr, "usage: %s [-s size in MB] [-n count] [-o options] benchmark...\nbenchmarks:", argv[0]);
+		for(b = 0; b < NBENCHMARKS; b++){
+			fprintf(stderr, " %s", benchmarks[b].name);
+		}
+		fprintf(stderr, "\n");
+		return 2;
+	}
+
+	char scratch[] = "cs1550_bench.XXXXXX";
+	if(mkdtemp(scratch) == NULL || chdir(scratch) != 0){
+		perror("cs1550_bench");
+		return 1;
+	}
+	int failed = 0;
+	for(i = optind; i < argc && !failed; i++){
+		for(b = 0; strcmp(argv[i], benchmarks[b].name) != 0; b++);
+		failed = benchmarks[b].run(count);
+		fflush(stdout);
+	}
+	unlink(".disk");
+	if(chdir("..") == 0){
+		rmdir(scratch);
+	}
+	return failed;
+}
@@ -0,0 +1,683 @@
+/*
+	cs1550_defrag: compact an unmounted cs1550 disk image so that every
+	directory and file sits in one contiguous run of blocks.
+
+	gcc -Wall -o cs1550_defrag cs1550_defrag.c
+	./cs1550_defrag [image]		(.disk if no image is given)
+
+	The compacted image is written next to the old one in a single pass, front
+	to back, and then renamed over it, so at any moment the image on disk is
+	either all old or all new.  Fragmentation is reported before and after.
+	Every block in use is checked against the image's checksums (if it has
+	them) before anything is copied, and the new image gets a table of its own.
+*/
+
+#define _FILE_OFFSET_BITS 64
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <libgen.h>
+#include <sys/stat.h>
+
+#include "cs1550_fs.h"
+
+//Blocks moved per read/write while copying a file
+#define COPY_BLOCKS 256
+
+//Where the pieces of an image are, from its superblock or the version 1 layout
+struct image_layout {
+	int version;
+	long nblocks;		//Blocks the FAT covers
+	long fat_start;
+	long fat_blocks;
+	long root_block;
+	long data_start;	//First block directories and files may use
+	long csum_start;	//The checksum table, if csum_blocks isn't 0
+	long csum_blocks;
+};
+
+//How scattered the files on an image are
+struct frag_stats {
+	long dirs;
+	long files;
+	long blocks;		//Blocks in use by directories and files
+	long fragmented;	//Files in more than one run
+	long runs;		//Runs of contiguous blocks over all files
+};
+
+//Read count blocks starting at block; anything past the end of the image reads as zeros
+static int read_blocks(int fd, long block, long count, void* data){
+	size_t len = count * BLOCK_SIZE;
+	size_t done = 0;
+	while(done < len){
+		ssize_t got = pread(fd, (char*) data + done, len - done, (off_t) block * BLOCK_SIZE + done);
+		if(got < 0 && errno == EINTR){
+			continue;
+		}
+		if(got < 0){
+			return -errno;
+		}
+		if(got == 0){
+			memset((char*) data + done, 0, len - done);
+			break;
+		}
+		done += got;
+	}
+	return 0;
+}
+
+//Write count blocks starting at block
+static int write_blocks(int fd, long block, long count, const void* data){
+	size_t len = count * BLOCK_SIZE;
+	size_t done = 0;
+	while(done < len){
+		ssize_t put = pwrite(fd, (const char*) data + done, len - done, (off_t) block * BLOCK_SIZE + done);
+		if(put < 0 && errno == EINTR){
+			continue;
+		}
+		if(put <= 0){
+			return put < 0 ? -errno : -EIO;
+		}
+		done += put;
+	}
+	return 0;
+}
+
+//Work out the image's format the same way the driver does at mount
+static int load_layout(int fd, struct image_layout* layout, cs1550_disk_superblock* disk_sb){
+	int res = read_blocks(fd, 0, 1, disk_sb);
+	if(res != 0){
+		return res;
+	}
+
+	if(disk_sb->magic == CS1550_MAGIC){
+		if(disk_sb->version != CS1550_VERSION || disk_sb->block_size != BLOCK_SIZE){
+			fprintf(stderr, "cs1550_defrag: unsupported disk version %u (block size %u)\n", disk_sb->version, disk_sb->block_size);
+			return -EINVAL;
+		}
+		layout->version = disk_sb->version;
+		layout->nblocks = disk_sb->nblocks;
+		layout->fat_start = disk_sb->fat_start;
+		layout->fat_blocks = disk_sb->fat_blocks;
+		layout->root_block = disk_sb->root_block;
+		layout->data_start = disk_sb->data_start;
+		layout->csum_start = disk_sb->csum_start;
+		layout->csum_blocks = disk_sb->csum_blocks;
+
+		//Committed metadata may still be waiting in the journal, and only the
+		//driver knows how to put it home
+		cs1550_journal_header header;
+		cs1550_journal_block first;
+		if(disk_sb->journal_blocks > 1 && read_blocks(fd, disk_sb->journal_start, 1, &header) == 0 &&
+			read_blocks(fd, disk_sb->journal_start + 1, 1, &first) == 0 &&
+			header.magic == JOURNAL_MAGIC && first.magic == JOURNAL_MAGIC && first.sequence == header.sequence){
+			fprintf(stderr, "cs1550_defrag: the journal has changes that were never put home; mount the image once to replay it\n");
+			return -EBUSY;
+		}
+
+		//A crash (or a mount with -o nocsum) can leave the checksum table
+		//behind the blocks; the driver rebuilds it at the next mount
+		if(disk_sb->csum_blocks > 0 && disk_sb->csum_state != CSUM_CLEAN){
+			fprintf(stderr, "cs1550_defrag: the image is mounted, wasn't unmounted cleanly or was mounted with -o nocsum; mount it once without -o nocsum to bring its checksums up to date\n");
+			return -EBUSY;
+		}
+	} else{ //No superblock: the original one-block-FAT layout
+		layout->version = 1;
+		layout->nblocks = MAX_FAT_ENTRIES;
+		layout->fat_start = 1;
+		layout->fat_blocks = 1;
+		layout->root_block = 0;
+		layout->data_start = START_ALLOC_BLOCK;
+		layout->csum_start = 0;
+		layout->csum_blocks = 0;
+	}
+	return 0;
+}
+
+//Read the whole FAT into one array of entries
+static long* load_fat(int fd, const struct image_layout* layout){
+	char* raw = malloc(layout->fat_blocks * BLOCK_SIZE);
+	long* fat = malloc(layout->nblocks * sizeof(long));
+	if(raw == NULL || fat == NULL || read_blocks(fd, layout->fat_start, layout->fat_blocks, raw) != 0){
+		free(raw);
+		free(fat);
+		return NULL;
+	}
+
+	long i = 0;
+	for(i = 0; i < layout->nblocks; i++){
+		fat[i] = (layout->version == 1) ? ((short*) raw)[i] : ((int32_t*) raw)[i];
+	}
+	free(raw);
+	return fat;
+}
+
+//Write a FAT array back out in the image's entry size
+static int store_fat(int fd, const struct image_layout* layout, const long* fat){
+	char* raw = calloc(layout->fat_blocks, BLOCK_SIZE);
+	if(raw == NULL){
+		return -ENOMEM;
+	}
+
+	long i = 0;
+	for(i = 0; i < layout->nblocks; i++){
+		if(layout->version == 1){
+			((short*) raw)[i] = fat[i];
+		} else{
+			((int32_t*) raw)[i] = fat[i];
+		}
+	}
+	int res = write_blocks(fd, layout->fat_start, layout->fat_blocks, raw);
+	free(raw);
+	return res;
+}
+
+//Whether block holds something the image uses: the FAT, the root, or a block
+//the FAT has handed out
+static int block_in_use(const struct image_layout* layout, const long* fat, long block){
+	return (block >= layout->fat_start && block < layout->fat_start + layout->fat_blocks) || block == layout->root_block ||
+		(block >= layout->data_start && block < layout->nblocks && fat[block] != 0);
+}
+
+//Check every block the image uses against its checksum table, if it has one,
+//so that damage isn't copied into the new image as good data.  Returns -1 if
+//any block doesn't match (or can't be read).
+static int verify_checksums(int fd, const struct image_layout* layout, const long* fat){
+	if(layout->csum_blocks == 0){
+		return 0;
+	}
+	uint32_t* table = malloc(layout->csum_blocks * BLOCK_SIZE);
+	char* buf = malloc(COPY_BLOCKS * BLOCK_SIZE);
+	if(table == NULL || buf == NULL || layout->csum_blocks < (long) CSUM_BLOCKS(layout->nblocks) ||
+		read_blocks(fd, layout->csum_start, layout->csum_blocks, table) != 0){
+		free(table);
+		free(buf);
+		return -1;
+	}
+
+	long bad = 0;
+	long block = layout->fat_start;
+	while(block < layout->nblocks){
+		if(!block_in_use(layout, fat, block)){
+			block++;
+			continue;
+		}
+		long run = 1;
+		while(run < COPY_BLOCKS && block + run < layout->nblocks && block_in_use(layout, fat, block + run)){
+			run++;
+		}
+		if(read_blocks(fd, block, run, buf) != 0){
+			bad++;
+			break;
+		}
+		long i = 0;
+		for(i = 0; i < run; i++){
+			if(table[block + i] != 0 && crc32c(0, buf + i * BLOCK_SIZE, BLOCK_SIZE) != table[block + i]){
+				fprintf(stderr, "cs1550_defrag: block %ld doesn't match its checksum\n", block + i);
+				bad++;
+			}
+		}
+		block += run;
+	}
+	free(table);
+	free(buf);
+	return bad ? -1 : 0;
+}
+
+//Give the compacted image a checksum table of its own, covering the FAT, the
+//root and everything up to end, which is all that was written to it
+static int store_checksums(int fd, const struct image_layout* layout, long end, char* buf){
+	if(layout->csum_blocks == 0){
+		return 0;
+	}
+	uint32_t* table = calloc(layout->csum_blocks, BLOCK_SIZE);
+	if(table == NULL){
+		return -ENOMEM;
+	}
+
+	long ranges[2][2] = { { layout->fat_start, layout->fat_start + layout->fat_blocks }, { layout->root_block, end } };
+	int res = 0;
+	int r = 0;
+	for(r = 0; r < 2 && res == 0; r++){
+		long block = ranges[r][0];
+		while(block < ranges[r][1] && res == 0){
+			long run = (ranges[r][1] - block < COPY_BLOCKS) ? ranges[r][1] - block : COPY_BLOCKS;
+			res = read_blocks(fd, block, run, buf);
+			long i = 0;
+			for(i = 0; i < run && res == 0; i++){
+				table[block + i] = crc32c(0, buf + i * BLOCK_SIZE, BLOCK_SIZE);
+			}
+			block += run;
+		}
+	}
+	if(res == 0){
+		res = write_blocks(fd, layout->csum_start, layout->csum_blocks, table);
+	}
+	free(table);
+	return res;
+}
+
+//Next block in a chain after a FAT entry, or EOF.  flag is set to FAT_HOLE if
+//the entry is a hole marker's, to FAT_PACKED if it starts a packed extent (on
+//images small enough to have them), and to 0 otherwise.  Version 1 entries
+//never have either set (EOF aside).
+static long chain_next(const struct image_layout* layout, long entry, int* flag){
+	*flag = 0;
+	if(entry != EOF && (entry & FAT_HOLE)){
+		*flag = FAT_HOLE;
+	} else if(entry != EOF && layout->nblocks <= FAT_PACKED && (entry & FAT_PACKED)){
+		*flag = FAT_PACKED;
+	}
+	if(*flag){
+		entry &= ~*flag;
+		return entry ? entry : EOF;
+	}
+	return entry;
+}
+
+//Follow a chain from start, marking its blocks in used and counting its runs.
+//Hole markers and the blocks of packed extents are blocks of the chain like any other.
+//Returns its length, or -1 if it leaves the data area, loops, or shares a
+//block with a chain already marked.
+static long walk_chain(const struct image_layout* layout, const long* fat, char* used, long start, long* runs){
+	long block = start;
+	long prev = -1;
+	long length = 0;
+	*runs = 0;
+	while(block != EOF){
+		if(block < layout->data_start || block >= layout->nblocks || used[block]){
+			return -1;
+		}
+		used[block] = 1;
+		if(block != prev + 1){ //Doesn't follow on from the block before
+			(*runs)++;
+		}
+		prev = block;
+		length++;
+		int flag = 0;
+		block = chain_next(layout, fat[block], &flag);
+	}
+	return length;
+}
+
+//Collect the nodes of a directory's index, root first, into a new array in
+//*nodes.  Returns how many there are, or -1 if the index is damaged.
+static long index_nodes(int fd, const struct image_layout* layout, long root, long** nodes){
+	long count = 0;
+	long capacity = 16;
+	long i = 0;
+	*nodes = malloc(capacity * sizeof(long));
+	if(*nodes == NULL){
+		return -1;
+	}
+	(*nodes)[count++] = root;
+	for(i = 0; i < count; i++){
+		cs1550_dir_node node;
+		if((*nodes)[i] < layout->data_start || (*nodes)[i] >= layout->nblocks || count > layout->nblocks ||
+			read_blocks(fd, (*nodes)[i], 1, &node) != 0 || node.magic != DIR_NODE_MAGIC){
+			free(*nodes);
+			return -1;
+		}
+		uint32_t c = 0;
+		for(c = 0; node.depth > 0 && c < node.count && c < DIR_NODE_ENTRIES; c++){
+			if(count == capacity){
+				long* grown = realloc(*nodes, capacity * 2 * sizeof(long));
+				if(grown == NULL){
+					free(*nodes);
+					return -1;
+				}
+				*nodes = grown;
+				capacity *= 2;
+			}
+			(*nodes)[count++] = node.children[c].block;
+		}
+	}
+	return count;
+}
+
+//Count how fragmented the image described by fat and root is.  Returns -1 if
+//any chain is broken or two chains share a block.
+static int measure(int fd, const struct image_layout* layout, const long* fat, const cs1550_root_directory* root, struct frag_stats* stats){
+	char* used = calloc(layout->nblocks, 1);
+	if(used == NULL){
+		return -ENOMEM;
+	}
+
+	memset(stats, 0, sizeof(struct frag_stats));
+	int res = 0;
+	int d = 0;
+	for(d = 0; d < (int) (MAX_DIRS_IN_ROOT) && res == 0; d++){
+		const struct cs1550_directory* dir = &root->directories[d];
+		if(dir->dname[0] == '\0'){
+			continue;
+		}
+
+		//The directory's chain (its first block, then the root of its index and
+		//the rest of its blocks if it has grown) and the other index nodes
+		long runs = 0;
+		long dir_length = walk_chain(layout, fat, used, dir->nStartBlock, &runs);
+		long* nodes = NULL;
+		long nnodes = (dir_length > 1) ? index_nodes(fd, layout, fat[dir->nStartBlock], &nodes) : 0;
+		long n = 0;
+		for(n = 1; n < nnodes && dir_length > 0; n++){
+			if(walk_chain(layout, fat, used, nodes[n], &runs) != 1){
+				dir_length = -1;
+			}
+		}
+		free(nodes);
+		if(dir_length < 1 || nnodes < 0){
+			fprintf(stderr, "cs1550_defrag: directory %s is damaged\n", dir->dname);
+			res = -EINVAL;
+			break;
+		}
+		stats->dirs++;
+		stats->blocks += dir_length + (nnodes > 0 ? nnodes - 1 : 0);
+
+		long block = dir->nStartBlock;
+		for(n = 0; n < dir_length && res == 0; n++, block = fat[block]){
+			cs1550_directory_entry entry;
+			if(n == 1){ //The index's root
+				continue;
+			}
+			if(read_blocks(fd, block, 1, &entry) != 0){
+				res = -EIO;
+				break;
+			}
+
+			int f = 0;
+			for(f = 0; f < (int) (MAX_FILES_IN_DIR); f++){
+				const struct cs1550_file_directory* file = &entry.files[f];
+				if(file->fname[0] == '\0'){
+					continue;
+				}
+				if(INLINE_FILE(file->nStartBlock)){ //In one piece, in the directory block
+					stats->files++;
+					stats->runs++;
+					continue;
+				}
+				long length = walk_chain(layout, fat, used, file->nStartBlock, &runs);
+				if(length < 0){
+					fprintf(stderr, "cs1550_defrag: %s/%s.%s has a broken or shared FAT chain\n", dir->dname, file->fname, file->fext);
+					res = -EINVAL;
+					break;
+				}
+				stats->files++;
+				stats->blocks += length;
+				stats->runs += runs;
+				if(runs > 1){
+					stats->fragmented++;
+				}
+			}
+		}
+	}
+
+	free(used);
+	return res;
+}
+
+static void report(const char* when, const struct frag_stats* stats){
+	printf("%s: %ld directories, %ld files in %ld blocks; %ld files fragmented, %.2f runs per file\n",
+		when, stats->dirs, stats->files, stats->blocks, stats->fragmented,
+		stats->files ? (double) stats->runs / stats->files : 0.0);
+}
+
+//Copy a file's chain from the old image to new_fd starting at block next, and
+//chain the copies in new_fat.  Old runs are read as one piece where they are
+//contiguous, and the copies go out strictly in order.  Hole markers and packed
+//extents are copied along with the rest and keep their flag; an extent's blocks
+//stay contiguous, which is all its links inside it say.
+static int copy_chain(int old_fd, int new_fd, const struct image_layout* layout, const long* fat, long* new_fat, long start, long next, char* buf){
+	long block = start;
+	while(block != EOF){
+		//Gather up to COPY_BLOCKS blocks that are contiguous in the old image (a marker ends the run)
+		long count = 1;
+		while(count < COPY_BLOCKS && fat[block + count - 1] == block + count){
+			count++;
+		}
+
+		int res = read_blocks(old_fd, block, count, buf);
+		if(res == 0){
+			res = write_blocks(new_fd, next, count, buf);
+		}
+		if(res != 0){
+			return res;
+		}
+
+		long i = 0;
+		for(i = 0; i < count; i++){
+			new_fat[next + i] = next + i + 1;
+		}
+		next += count;
+
+		int flag = 0;
+		block = chain_next(layout, fat[block + count - 1], &flag);
+		if(block == EOF){
+			new_fat[next - 1] = flag ? flag : EOF;
+		} else if(flag){
+			new_fat[next - 1] |= flag;
+		}
+	}
+	return 0;
+}
+
+//Copy the nodes of a directory's index to where moved says they go, pointing
+//them at where the directory's blocks and their other nodes went too
+static int copy_index(int old_fd, int new_fd, const struct image_layout* layout, const long* nodes, long nnodes, const long* moved){
+	long n = 0;
+	for(n = 0; n < nnodes; n++){
+		cs1550_dir_node node;
+		int res = read_blocks(old_fd, nodes[n], 1, &node);
+		if(res != 0){
+			return res;
+		}
+
+		uint32_t i = 0;
+		if(node.depth == 0){
+			for(i = 0; i < node.count && i < DIR_LEAF_ENTRIES; i++){
+				if(node.names[i].block >= layout->nblocks || moved[node.names[i].block] == 0){ //Not one of the directory's blocks
+					return -EINVAL;
+				}
+				node.names[i].block = moved[node.names[i].block];
+			}
+			if(node.next != 0){
+				if(node.next >= layout->nblocks || moved[node.next] == 0){
+					return -EINVAL;
+				}
+				node.next = moved[node.next];
+			}
+		} else{
+			for(i = 0; i < node.count && i < DIR_NODE_ENTRIES; i++){
+				node.children[i].block = moved[node.children[i].block]; //Checked by index_nodes()
+			}
+		}
+		res = write_blocks(new_fd, moved[nodes[n]], 1, &node);
+		if(res != 0){
+			return res;
+		}
+	}
+	return 0;
+}
+
+int main(int argc, char* argv[]){
+	const char* image = (argc > 1) ? argv[1] : ".disk";
+	if(argc > 2){
+		fprintf(stderr, "usage: %s [image]\n", argv[0]);
+		return 2;
+	}
+	crc32c_init();
+
+	int old_fd = open(image, O_RDONLY);
+	struct stat st;
+	if(old_fd < 0 || fstat(old_fd, &st) != 0){
+		fprintf(stderr, "cs1550_defrag: %s: %s\n", image, strerror(errno));
+		return 1;
+	}
+
+	struct image_layout layout;
+	cs1550_disk_superblock disk_sb;
+	cs1550_root_directory root;
+	struct frag_stats before;
+	long* fat = NULL;
+	if(load_layout(old_fd, &layout, &disk_sb) != 0 || (fat = load_fat(old_fd, &layout)) == NULL ||
+		read_blocks(old_fd, layout.root_block, 1, &root) != 0 || measure(old_fd, &layout, fat, &root, &before) != 0){
+		fprintf(stderr, "cs1550_defrag: %s is not a usable cs1550 image; left as it was\n", image);
+		return 1;
+	}
+	report("before", &before);
+	if(verify_checksums(old_fd, &layout, fat) != 0){
+		fprintf(stderr, "cs1550_defrag: %s has blocks that fail their checksums; left as it was\n", image);
+		return 1;
+	}
+
+	long allocated = 0; //Blocks the FAT has in use, reachable or not
+	long i = 0;
+	for(i = layout.data_start; i < layout.nblocks; i++){
+		if(fat[i] != 0){
+			allocated++;
+		}
+	}
+
+	//The new image: same size and format, metadata where it was, then each
+	//directory block followed by its files, one run each
+	char* tmp_path = malloc(strlen(image) + sizeof(".defrag"));
+	long* new_fat = calloc(layout.nblocks, sizeof(long));
+	char* buf = malloc(COPY_BLOCKS * BLOCK_SIZE);
+	long* moved = calloc(layout.nblocks, sizeof(long)); //Where each directory block and index node went
+	if(tmp_path == NULL || new_fat == NULL || buf == NULL || moved == NULL){
+		fprintf(stderr, "cs1550_defrag: out of memory\n");
+		return 1;
+	}
+	sprintf(tmp_path, "%s.defrag", image);
+	int new_fd = open(tmp_path, O_RDWR | O_CREAT | O_TRUNC, st.st_mode & 0777);
+	if(new_fd < 0 || ftruncate(new_fd, st.st_size) != 0){
+		fprintf(stderr, "cs1550_defrag: %s: %s\n", tmp_path, strerror(errno));
+		return 1;
+	}
+
+	for(i = 0; i < layout.data_start; i++){ //Whatever the reserved entries say, keep it
+		new_fat[i] = fat[i];
+	}
+
+	int res = 0;
+	long next = layout.data_start;
+	int d = 0;
+	for(d = 0; d < (int) (MAX_DIRS_IN_ROOT) && res == 0; d++){
+		struct cs1550_directory* dir = &root.directories[d];
+		if(dir->dname[0] == '\0'){
+			continue;
+		}
+
+		//The directory's chain in one run, then the rest of its index, then its files
+		long old_start = dir->nStartBlock;
+		long dir_length = 0;
+		long block = old_start;
+		while(block != EOF){
+			moved[block] = next + dir_length;
+			new_fat[next + dir_length] = next + dir_length + 1;
+			dir_length++;
+			block = fat[block];
+		}
+		new_fat[next + dir_length - 1] = EOF;
+		dir->nStartBlock = next;
+		next += dir_length;
+
+		long* nodes = NULL;
+		long nnodes = (dir_length > 1) ? index_nodes(old_fd, &layout, fat[old_start], &nodes) : 0;
+		long n = 0;
+		for(n = 1; n < nnodes; n++){
+			moved[nodes[n]] = next;
+			new_fat[next++] = EOF;
+		}
+		if(nnodes > 0){
+			res = copy_index(old_fd, new_fd, &layout, nodes, nnodes, moved);
+		}
+		free(nodes);
+
+		block = old_start;
+		for(n = 0; n < dir_length && res == 0; n++, block = fat[block]){
+			cs1550_directory_entry entry;
+			if(n == 1){ //The index's root, copied above
+				continue;
+			}
+			res = read_blocks(old_fd, block, 1, &entry);
+
+			int f = 0;
+			for(f = 0; f < (int) (MAX_FILES_IN_DIR) && res == 0; f++){
+				struct cs1550_file_directory* file = &entry.files[f];
+				if(file->fname[0] == '\0' || INLINE_FILE(file->nStartBlock)){ //Inline files move with the directory block
+					continue;
+				}
+				long start = next;
+				long length = 0;
+				long file_block = file->nStartBlock;
+				while(file_block != EOF){
+					int flag = 0;
+					length++;
+					file_block = chain_next(&layout, fat[file_block], &flag);
+				}
+				res = copy_chain(old_fd, new_fd, &layout, fat, new_fat, file->nStartBlock, start, buf);
+				file->nStartBlock = start;
+				next += length;
+			}
+			if(res == 0){
+				res = write_blocks(new_fd, moved[block], 1, &entry);
+			}
+		}
+	}
+
+	if(res == 0 && layout.version != 1){
+		res = write_blocks(new_fd, 0, 1, &disk_sb);
+	}
+	if(res == 0){
+		res = write_blocks(new_fd, layout.root_block, 1, &root);
+	}
+	if(res == 0){
+		res = store_fat(new_fd, &layout, new_fat);
+	}
+	if(res == 0){
+		res = store_checksums(new_fd, &layout, next, buf);
+	}
+
+	struct frag_stats after;
+	if(res == 0 && measure(new_fd, &layout, new_fat, &root, &after) != 0){
+		res = -EIO;
+	}
+	if(res == 0 && fsync(new_fd) != 0){
+		res = -errno;
+	}
+	close(new_fd);
+
+	//Swap the new image in, and make the rename itself durable
+	if(res == 0 && rename(tmp_path, image) != 0){
+		res = -errno;
+	}
+	if(res != 0){
+		fprintf(stderr, "cs1550_defrag: %s; %s left as it was\n", strerror(-res), image);
+		unlink(tmp_path);
+		return 1;
+	}
+	char* dir_path = strdup(image);
+	int dir_fd = open(dirname(dir_path), O_RDONLY);
+	if(dir_fd >= 0){
+		fsync(dir_fd);
+		close(dir_fd);
+	}
+
+	report("after", &after);
+	if(allocated > after.blocks){ //Chains nothing pointed to, e.g. from a file deleted while open at a crash
+		printf("%ld unreachable blocks freed\n", allocated - after.blocks);
+	}
+
+	close(old_fd);
+	free(dir_path);
+	free(tmp_path);
+	free(new_fat);
+	free(moved);
+	free(fat);
+	free(buf);
+	return 0;
+}
@@ -0,0 +1,668 @@
+/*
+	On-disk format of a cs1550 filesystem image, shared by the FUSE driver
+	(cs1550_1.c) and the offline tools that work on unmounted images.
+*/
+
+#ifndef CS1550_FS_H
+#define CS1550_FS_H
+
+#include <stdint.h>
+#include <stdio.h>	//EOF marks the end of a FAT chain
+#include <string.h>
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <nmmintrin.h>	//SSE4.2 crc32, for the checksum table
+#endif
+
+//size of a disk block
+#define	BLOCK_SIZE 512
+
+//we'll use 8.3 filenames
+#define	MAX_FILENAME 8
+#define	MAX_EXTENSION 3
+
+//How many files can there be in one directory?
+#define MAX_FILES_IN_DIR (BLOCK_SIZE - sizeof(int)) / ((MAX_FILENAME + 1) + (MAX_EXTENSION + 1) + sizeof(size_t) + sizeof(long))
+
+//The attribute packed means to not align these things
+struct cs1550_directory_entry
+{
+	int nFiles;	//How many files are in this directory.
+				//Needs to be less than MAX_FILES_IN_DIR
+
+	struct cs1550_file_directory
+	{
+		char fname[MAX_FILENAME + 1];	//filename (plus space for nul)
+		char fext[MAX_EXTENSION + 1];	//extension (plus space for nul)
+		size_t fsize;					//file size
+		long nStartBlock;				//where the first block is on disk
+	} __attribute__((packed)) files[MAX_FILES_IN_DIR];	//There is an array of these
+
+	//This is some space to get this to be exactly the size of the disk block.
+	//Don't use it for anything.
+	char padding[BLOCK_SIZE - MAX_FILES_IN_DIR * sizeof(struct cs1550_file_directory) - sizeof(int)];
+} ;
+
+typedef struct cs1550_root_directory cs1550_root_directory;
+
+#define MAX_DIRS_IN_ROOT (BLOCK_SIZE - sizeof(int)) / ((MAX_FILENAME + 1) + sizeof(long))
+
+struct cs1550_root_directory
+{
+	int nDirectories;	//How many subdirectories are in the root
+						//Needs to be less than MAX_DIRS_IN_ROOT
+	struct cs1550_directory
+	{
+		char dname[MAX_FILENAME + 1];	//directory name (plus space for nul)
+		long nStartBlock;				//where the directory block is on disk
+	} __attribute__((packed)) directories[MAX_DIRS_IN_ROOT];	//There is an array of these
+
+	//This is some space to get this to be exactly the size of the disk block.
+	//Don't use it for anything.
+	char padding[BLOCK_SIZE - MAX_DIRS_IN_ROOT * sizeof(struct cs1550_directory) - sizeof(int)];
+} ;
+
+typedef struct cs1550_directory_entry cs1550_directory_entry;
+
+//How much data can one block hold?
+#define	MAX_DATA_IN_BLOCK (BLOCK_SIZE)
+
+struct cs1550_disk_block
+{
+	//All of the space in the block can be used for actual data
+	//storage.
+	char data[MAX_DATA_IN_BLOCK];
+};
+
+typedef struct cs1550_disk_block cs1550_disk_block;
+
+#define MAX_FAT_ENTRIES (BLOCK_SIZE/sizeof(short))
+
+struct cs1550_file_alloc_table_block {
+	short table[MAX_FAT_ENTRIES];
+};
+
+typedef struct cs1550_file_alloc_table_block cs1550_fat_block;
+
+#define START_ALLOC_BLOCK 2 //block 0 = root; block 1 = FAT; start allocation of directories and files at block 2 in the allocation table
+
+//Version 1 is the original layout above: the root in block 0 and a single
+//FAT block of shorts in block 1, which caps the disk at MAX_FAT_ENTRIES blocks.
+//Version 2 puts a superblock in block 0 that says how long the FAT is; the FAT
+//holds 32-bit entries and spans as many blocks as the image needs, followed by
+//the metadata journal (if the image has one), the checksum table (likewise),
+//the root and then the blocks handed out to directories and files.
+#define CS1550_MAGIC 0x30353531	//"1550" in a little-endian dump
+#define CS1550_VERSION 2
+
+#define FAT_ENTRIES_PER_BLOCK (BLOCK_SIZE/sizeof(int32_t))
+
+//A version 2 file can have holes: runs of blocks that read as zeros and have
+//nothing on disk.  Each hole is one marker block in the file's chain, whose FAT
+//entry has FAT_HOLE set on top of the next block of the chain (or on top of 0
+//if the hole ends the file).  The marker starts with the hole's length in
+//blocks as an int64_t; nothing else in it is used.  Block numbers stay below
+//FAT_HOLE so the flag never collides with one.
+#define FAT_HOLE 0x40000000
+
+//A version 2 file can also keep groups of up to PACK_BLOCKS of its blocks
+//compressed (-o compress).  Each group is a packed extent: a run of blocks next
+//to each other on disk, as many as its compressed bytes need, that stands for
+//the group in the file's chain.  The FAT entry of its first block has
+//FAT_PACKED set on top of the link to the next block (or on top of 0 if the
+//extent is one block and ends the file); the rest of the run is linked as
+//usual.  The extent starts with a cs1550_packed_header and the compressed
+//bytes follow it, in the format lz_decompress reads.  Only images of at most
+//FAT_PACKED blocks have them, so block numbers never collide with the flag.
+#define FAT_PACKED 0x20000000
+#define PACK_BLOCKS 8
+#define PACK_MAGIC 0x4b434150	//"PACK" in a little-endian dump
+
+struct cs1550_packed_header {
+	uint32_t magic;		//PACK_MAGIC
+	uint32_t blocks;	//File blocks the extent holds, 1 to PACK_BLOCKS
+	uint32_t bytes;		//Compressed bytes after the header
+};
+
+typedef struct cs1550_packed_header cs1550_packed_header;
+
+//Blocks a packed extent of bytes compressed bytes takes on disk
+#define PACKED_EXTENT_BLOCKS(bytes) ((sizeof(cs1550_packed_header) + (bytes) + BLOCK_SIZE - 1) / BLOCK_SIZE)
+
+//A version 2 file of at most INLINE_MAX_SIZE bytes can live in its directory's
+//block instead of in blocks of its own.  Its nStartBlock is INLINE_DATA plus
+//where its bytes start in the directory block, and fsize says how many there
+//are.  Inline data is packed at the end of the block, past every slot in use;
+//it skips the first byte of any empty slot it runs over, so that slot still
+//reads as empty.  Block numbers never get anywhere near INLINE_DATA.
+#define INLINE_DATA 0x10000000000L
+#define INLINE_MAX_SIZE 128
+#define INLINE_FILE(start) ((long) (start) >= INLINE_DATA)
+
+//A version 2 directory can outgrow its block.  Its first block then heads a
+//FAT chain: the next block is the root of the directory's index, and every one
+//after that holds more entries, laid out like the first.  Entries never move
+//once they are made, so a file keeps its block and slot for as long as it
+//exists.  The index is a B+tree of cs1550_dir_node blocks keyed on each file's
+//DIR_HASH; its leaves say which block and slot has the file, and list the free
+//slots as well, under DIR_HASH_FREE.  Equal hashes may span leaves.  The root
+//never moves and the other nodes are chains of one block; nodes that empty out
+//stay where they are.
+#define DIR_NODE_MAGIC 0x52444e49	//"INDR" in a little-endian dump
+#define DIR_HASH_FREE 0xffffffffu
+#define DIR_LEAF_ENTRIES ((BLOCK_SIZE - 4 * sizeof(uint32_t)) / (3 * sizeof(uint32_t)))
+#define DIR_NODE_ENTRIES ((BLOCK_SIZE - 4 * sizeof(uint32_t)) / (2 * sizeof(uint32_t)))
+
+struct cs1550_dir_node {
+	uint32_t magic;		//DIR_NODE_MAGIC
+	uint32_t depth;		//Levels of nodes below this one; 0 for a leaf
+	uint32_t count;		//Entries in use
+	uint32_t next;		//Leaf: the next leaf in hash order, or 0 for the last one
+	union {
+		struct cs1550_dir_name {
+			uint32_t hash;	//DIR_HASH of the file's name, or DIR_HASH_FREE
+			uint32_t block;	//Directory block the entry is in
+			uint32_t slot;	//Its slot there
+		} names[DIR_LEAF_ENTRIES];	//Leaf: in hash order
+		struct cs1550_dir_child {
+			uint32_t hash;	//No hash under this child is lower (ignored for the first)
+			uint32_t block;	//Where the child is
+		} children[DIR_NODE_ENTRIES];	//Inner node: in hash order
+	};
+};
+
+typedef struct cs1550_dir_node cs1550_dir_node;
+
+//DIR_HASH: 32-bit FNV-1a of "fname.fext", kept off DIR_HASH_FREE
+static inline uint32_t dir_hash(const char* fname, const char* fext){
+	uint32_t hash = 2166136261u;
+	const char* parts[3] = { fname, ".", fext };
+	int i = 0;
+	for(i = 0; i < 3; i++){
+		const char* c = parts[i];
+		while(*c){
+			hash = (hash ^ (unsigned char) *c++) * 16777619u;
+		}
+	}
+	return (hash == DIR_HASH_FREE) ? DIR_HASH_FREE - 1 : hash;
+}
+
+struct cs1550_disk_superblock {
+	uint32_t magic;		//CS1550_MAGIC; anything else means a version 1 disk
+	uint32_t version;	//CS1550_VERSION
+	uint32_t block_size;	//BLOCK_SIZE the image was made with
+	uint32_t nblocks;	//Blocks in the image, this one included
+	uint32_t fat_start;	//First block of the FAT
+	uint32_t fat_blocks;	//Length of the FAT in blocks
+	uint32_t root_block;	//Where the root directory lives
+	uint32_t data_start;	//First block that directories and files may use
+	uint32_t journal_start;	//First block of the journal (its header)
+	uint32_t journal_blocks;	//Length of the journal in blocks; 0 if there is none
+	uint32_t csum_start;	//First block of the checksum table
+	uint32_t csum_blocks;	//Length of the checksum table in blocks; 0 if there is none
+	uint32_t csum_state;	//CSUM_CLEAN or CSUM_STALE
+
+	//Pad out to exactly one disk block.
+	char padding[BLOCK_SIZE - 13 * sizeof(uint32_t)];
+};
+
+typedef struct cs1550_disk_superblock cs1550_disk_superblock;
+
+//How long a journal new images get: 1/64 of the disk, between 16 and 1024 blocks
+#define JOURNAL_DEFAULT_BLOCKS(nblocks) ((nblocks) / 64 < 16 ? 16 : (nblocks) / 64 > 1024 ? 1024 : (nblocks) / 64)
+
+//The journal is a redo log of whole metadata blocks.  Its first block is the
+//header; transactions follow it back to back.  A transaction is one or more
+//descriptor blocks, each followed by copies of the blocks it lists, and then a
+//commit block whose checksum covers everything before it in the transaction.
+//At mount, transactions are replayed in order starting with the header's
+//sequence number, up to the first one that is missing, torn or out of
+//sequence; then the header is moved past them and the journal is empty again.
+#define JOURNAL_MAGIC 0x4c4e524a	//"JRNL" in a little-endian dump
+#define JOURNAL_DESCRIPTOR 1
+#define JOURNAL_COMMIT 2
+#define JOURNAL_TAGS ((BLOCK_SIZE - 5 * sizeof(uint32_t)) / sizeof(uint32_t))
+
+struct cs1550_journal_header {
+	uint32_t magic;		//JOURNAL_MAGIC; anything else means the journal is empty
+	uint32_t sequence;	//Transaction expected right after the header
+
+	char padding[BLOCK_SIZE - 2 * sizeof(uint32_t)];
+};
+
+typedef struct cs1550_journal_header cs1550_journal_header;
+
+struct cs1550_journal_block {
+	uint32_t magic;		//JOURNAL_MAGIC
+	uint32_t type;		//JOURNAL_DESCRIPTOR or JOURNAL_COMMIT
+	uint32_t sequence;	//Transaction this block belongs to
+	uint32_t count;		//Descriptor: blocks listed in tags; commit: blocks in the transaction before it
+	uint32_t checksum;	//Commit: over every block in the transaction before it
+	uint32_t tags[JOURNAL_TAGS];	//Descriptor: where each block that follows goes
+};
+
+typedef struct cs1550_journal_block cs1550_journal_block;
+
+//The checksum table holds a CRC32C of every block of the image, one uint32_t
+//per block in block order.  0 means nothing is recorded for the block, which is
+//how the table starts out; a block whose checksum really is 0 just goes
+//unchecked.  The superblock, the journal (which checks itself) and the table
+//are not covered.
+#define CSUM_ENTRIES_PER_BLOCK (BLOCK_SIZE/sizeof(uint32_t))
+#define CSUM_BLOCKS(nblocks) (((nblocks) + CSUM_ENTRIES_PER_BLOCK - 1) / CSUM_ENTRIES_PER_BLOCK)
+
+//Blocks reach the image whenever the cache evicts them, but the table only
+//when it is flushed, so while the image is mounted the table on disk can be
+//behind.  The superblock says CSUM_STALE from mount to a clean unmount; a
+//mount that finds it still set (after a crash, or a mount with -o nocsum,
+//which leaves the table alone) rebuilds the table from the blocks as they are
+//before trusting it.
+#define CSUM_CLEAN 0
+#define CSUM_STALE 1
+
+static const uint32_t crc32c_table[256] = {
+	0x00000000, 0xf26b8303, 0xe13b70f7, 0x1350f3f4, 0xc79a971f, 0x35f1141c, 0x26a1e7e8, 0xd4ca64eb,
+	0x8ad958cf, 0x78b2dbcc, 0x6be22838, 0x9989ab3b, 0x4d43cfd0, 0xbf284cd3, 0xac78bf27, 0x5e133c24,
+	0x105ec76f, 0xe235446c, 0xf165b798, 0x030e349b, 0xd7c45070, 0x25afd373, 0x36ff2087, 0xc494a384,
+	0x9a879fa0, 0x68ec1ca3, 0x7bbcef57, 0x89d76c54, 0x5d1d08bf, 0xaf768bbc, 0xbc267848, 0x4e4dfb4b,
+	0x20bd8ede, 0xd2d60ddd, 0xc186fe29, 0x33ed7d2a, 0xe72719c1, 0x154c9ac2, 0x061c6936, 0xf477ea35,
+	0xaa64d611, 0x580f5512, 0x4b5fa6e6, 0xb93425e5, 0x6dfe410e, 0x9f95c20d, 0x8cc531f9, 0x7eaeb2fa,
+	0x30e349b1, 0xc288cab2, 0xd1d83946, 0x23b3ba45, 0xf779deae, 0x05125dad, 0x1642ae59, 0xe4292d5a,
+	0xba3a117e, 0x4851927d, 0x5b016189, 0xa96ae28a, 0x7da08661, 0x8fcb0562, 0x9c9bf696, 0x6ef07595,
+	0x417b1dbc, 0xb3109ebf, 0xa0406d4b, 0x522bee48, 0x86e18aa3, 0x748a09a0, 0x67dafa54, 0x95b17957,
+	0xcba24573, 0x39c9c670, 0x2a993584, 0xd8f2b687, 0x0c38d26c, 0xfe53516f, 0xed03a29b, 0x1f682198,
+	0x5125dad3, 0xa34e59d0, 0xb01eaa24, 0x42752927, 0x96bf4dcc, 0x64d4cecf, 0x77843d3b, 0x85efbe38,
+	0xdbfc821c, 0x2997011f, 0x3ac7f2eb, 0xc8ac71e8, 0x1c661503, 0xee0d9600, 0xfd5d65f4, 0x0f36e6f7,
+	0x61c69362, 0x93ad1061, 0x80fde395, 0x72966096, 0xa65c047d, 0x5437877e, 0x4767748a, 0xb50cf789,
+	0xeb1fcbad, 0x197448ae, 0x0a24bb5a, 0xf84f3859, 0x2c855cb2, 0xdeeedfb1, 0xcdbe2c45, 0x3fd5af46,
+	0x7198540d, 0x83f3d70e, 0x90a324fa, 0x62c8a7f9, 0xb602c312, 0x44694011, 0x5739b3e5, 0xa55230e6,
+	0xfb410cc2, 0x092a8fc1, 0x1a7a7c35, 0xe811ff36, 0x3cdb9bdd, 0xceb018de, 0xdde0eb2a, 0x2f8b6829,
+	0x82f63b78, 0x709db87b, 0x63cd4b8f, 0x91a6c88c, 0x456cac67, 0xb7072f64, 0xa457dc90, 0x563c5f93,
+	0x082f63b7, 0xfa44e0b4, 0xe9141340, 0x1b7f9043, 0xcfb5f4a8, 0x3dde77ab, 0x2e8e845f, 0xdce5075c,
+	0x92a8fc17, 0x60c37f14, 0x73938ce0, 0x81f80fe3, 0x55326b08, 0xa759e80b, 0xb4091bff, 0x466298fc,
+	0x1871a4d8, 0xea1a27db, 0xf94ad42f, 0x0b21572c, 0xdfeb33c7, 0x2d80b0c4, 0x3ed04330, 0xccbbc033,
+	0xa24bb5a6, 0x502036a5, 0x4370c551, 0xb11b4652, 0x65d122b9, 0x97baa1ba, 0x84ea524e, 0x7681d14d,
+	0x2892ed69, 0xdaf96e6a, 0xc9a99d9e, 0x3bc21e9d, 0xef087a76, 0x1d63f975, 0x0e330a81, 0xfc588982,
+	0xb21572c9, 0x407ef1ca, 0x532e023e, 0xa145813d, 0x758fe5d6, 0x87e466d5, 0x94b49521, 0x66df1622,
+	0x38cc2a06, 0xcaa7a905, 0xd9f75af1, 0x2b9cd9f2, 0xff56bd19, 0x0d3d3e1a, 0x1e6dcdee, 0xec064eed,
+	0xc38d26c4, 0x31e6a5c7, 0x22b65633, 0xd0ddd530, 0x0417b1db, 0xf67c32d8, 0xe52cc12c, 0x1747422f,
+	0x49547e0b, 0xbb3ffd08, 0xa86f0efc, 0x5a048dff, 0x8ecee914, 0x7ca56a17, 0x6ff599e3, 0x9d9e1ae0,
+	0xd3d3e1ab, 0x21b862a8, 0x32e8915c, 0xc083125f, 0x144976b4, 0xe622f5b7, 0xf5720643, 0x07198540,
+	0x590ab964, 0xab613a67, 0xb831c993, 0x4a5a4a90, 0x9e902e7b, 0x6cfbad78, 0x7fab5e8c, 0x8dc0dd8f,
+	0xe330a81a, 0x115b2b19, 0x020bd8ed, 0xf0605bee, 0x24aa3f05, 0xd6c1bc06, 0xc5914ff2, 0x37faccf1,
+	0x69e9f0d5, 0x9b8273d6, 0x88d28022, 0x7ab90321, 0xae7367ca, 0x5c18e4c9, 0x4f48173d, 0xbd23943e,
+	0xf36e6f75, 0x0105ec76, 0x12551f82, 0xe03e9c81, 0x34f4f86a, 0xc69f7b69, 0xd5cf889d, 0x27a40b9e,
+	0x79b737ba, 0x8bdcb4b9, 0x988c474d, 0x6ae7c44e, 0xbe2da0a5, 0x4c4623a6, 0x5f16d052, 0xad7d5351
+};
+
+//CRC32C (Castagnoli, reflected 0x82f63b78) a byte at a time.  Like the rest
+//below, this works on the bare register: crc32c() adds the inversions.
+static inline uint32_t crc32c_bytes(uint32_t crc, const unsigned char* data, size_t len){
+	while(len-- > 0){
+		crc = crc32c_table[(crc ^ *data++) & 0xff] ^ (crc >> 8);
+	}
+	return crc;
+}
+
+//Bytes each of the three interleaved SSE4.2 streams covers per round: three
+//of them fill all but the last eight bytes of a block
+#define CRC32C_STRIDE 168
+
+//crc32c_table extended for slicing-by-8, and the register after
+//CRC32C_STRIDE zero bytes, a byte of the register at a time (see
+//crc32c_shift).  Filled in by crc32c_init.
+static uint32_t crc32c_slices[8][256];
+static uint32_t crc32c_stride[4][256];
+
+//Slicing-by-8: eight bytes per step through eight tables, for CPUs without
+//the crc32 instruction
+static inline uint32_t crc32c_sliced(uint32_t crc, const unsigned char* data, size_t len){
+	while(len >= 8){
+		uint32_t lo = crc ^ (data[0] | (uint32_t) data[1] << 8 | (uint32_t) data[2] << 16 | (uint32_t) data[3] << 24);
+		uint32_t hi = data[4] | (uint32_t) data[5] << 8 | (uint32_t) data[6] << 16 | (uint32_t) data[7] << 24;
+		crc = crc32c_slices[7][lo & 0xff] ^ crc32c_slices[6][(lo >> 8) & 0xff] ^
+			crc32c_slices[5][(lo >> 16) & 0xff] ^ crc32c_slices[4][lo >> 24] ^
+			crc32c_slices[3][hi & 0xff] ^ crc32c_slices[2][(hi >> 8) & 0xff] ^
+			crc32c_slices[1][(hi >> 16) & 0xff] ^ crc32c_slices[0][hi >> 24];
+		data += 8;
+		len -= 8;
+	}
+	return crc32c_bytes(crc, data, len);
+}
+
+//The register as it would be after CRC32C_STRIDE more zero bytes.  The CRC is
+//linear, so that moves a stream's CRC past the streams after it, and the
+//three of a round are put together as shift(shift(a) ^ b) ^ c.
+static inline uint32_t crc32c_shift(uint32_t crc){
+	return crc32c_stride[0][crc & 0xff] ^ crc32c_stride[1][(crc >> 8) & 0xff] ^
+		crc32c_stride[2][(crc >> 16) & 0xff] ^ crc32c_stride[3][crc >> 24];
+}
+
+#if defined(__x86_64__) && defined(__GNUC__)
+//The same with the SSE4.2 crc32 instruction.  Each crc32 has to wait for the
+//one before it, so three streams over the thirds of each round keep the
+//instruction busy, and are shifted together at the end of the round.
+__attribute__((target("sse4.2")))
+static inline uint32_t crc32c_sse42(uint32_t crc, const unsigned char* data, size_t len){
+	uint64_t word;
+	while(len >= 3 * CRC32C_STRIDE){
+		uint64_t a = crc;
+		uint64_t b = 0;
+		uint64_t c = 0;
+		size_t i = 0;
+		for(i = 0; i < CRC32C_STRIDE; i += sizeof(uint64_t)){
+			memcpy(&word, data + i, sizeof(uint64_t));
+			a = _mm_crc32_u64(a, word);
+			memcpy(&word, data + CRC32C_STRIDE + i, sizeof(uint64_t));
+			b = _mm_crc32_u64(b, word);
+			memcpy(&word, data + 2 * CRC32C_STRIDE + i, sizeof(uint64_t));
+			c = _mm_crc32_u64(c, word);
+		}
+		crc = crc32c_shift(crc32c_shift((uint32_t) a) ^ (uint32_t) b) ^ (uint32_t) c;
+		data += 3 * CRC32C_STRIDE;
+		len -= 3 * CRC32C_STRIDE;
+	}
+	uint64_t wide = crc;
+	while(len >= sizeof(uint64_t)){
+		memcpy(&word, data, sizeof(uint64_t));
+		wide = _mm_crc32_u64(wide, word);
+		data += sizeof(uint64_t);
+		len -= sizeof(uint64_t);
+	}
+	crc = (uint32_t) wide;
+	while(len-- > 0){
+		crc = _mm_crc32_u8(crc, *data++);
+	}
+	return crc;
+}
+#endif
+
+//Each of count whole blocks on its own, through crc32c_impl
+static void crc32c_each(const unsigned char* const* blocks, long count, uint32_t* crcs);
+
+#if defined(__x86_64__) && defined(__GNUC__)
+//Each of count whole blocks on its own with SSE4.2.  Separate blocks are
+//separate CRCs, so three at a time make the three streams with nothing to
+//shift together.
+__attribute__((target("sse4.2")))
+static void crc32c_each_sse42(const unsigned char* const* blocks, long count, uint32_t* crcs){
+	while(count >= 3){
+		uint64_t a = 0xffffffff;
+		uint64_t b = 0xffffffff;
+		uint64_t c = 0xffffffff;
+		uint64_t word;
+		size_t i = 0;
+		for(i = 0; i < BLOCK_SIZE; i += sizeof(uint64_t)){
+			memcpy(&word, blocks[0] + i, sizeof(uint64_t));
+			a = _mm_crc32_u64(a, word);
+			memcpy(&word, blocks[1] + i, sizeof(uint64_t));
+			b = _mm_crc32_u64(b, word);
+			memcpy(&word, blocks[2] + i, sizeof(uint64_t));
+			c = _mm_crc32_u64(c, word);
+		}
+		crcs[0] = ~(uint32_t) a;
+		crcs[1] = ~(uint32_t) b;
+		crcs[2] = ~(uint32_t) c;
+		blocks += 3;
+		crcs += 3;
+		count -= 3;
+	}
+	crc32c_each(blocks, count, crcs);
+}
+#endif
+
+static uint32_t crc32c_resolve(uint32_t crc, const unsigned char* data, size_t len);
+static void crc32c_resolve_blocks(const unsigned char* const* blocks, long count, uint32_t* crcs);
+
+//Which of the above crc32c() and crc32c_blocks() use, chosen once by crc32c_init
+static uint32_t (*crc32c_impl)(uint32_t, const unsigned char*, size_t) = crc32c_resolve;
+static void (*crc32c_blocks_impl)(const unsigned char* const*, long, uint32_t*) = crc32c_resolve_blocks;
+static const char* crc32c_kind = "not chosen yet";
+
+static void crc32c_each(const unsigned char* const* blocks, long count, uint32_t* crcs){
+	long i = 0;
+	for(i = 0; i < count; i++){
+		crcs[i] = ~crc32c_impl(0xffffffff, blocks[i], BLOCK_SIZE);
+	}
+}
+
+//Build the tables and pick the fastest CRC32C this CPU has.  Call it before
+//starting threads; a program that doesn't gets it on its first CRC.  Only the
+//first call does anything.
+static void crc32c_init(void){
+	int i = 0;
+	int k = 0;
+	if(crc32c_impl != crc32c_resolve){
+		return;
+	}
+	for(i = 0; i < 256; i++){
+		crc32c_slices[0][i] = crc32c_table[i];
+	}
+	for(k = 1; k < 8; k++){
+		for(i = 0; i < 256; i++){
+			uint32_t prev = crc32c_slices[k - 1][i];
+			crc32c_slices[k][i] = (prev >> 8) ^ crc32c_table[prev & 0xff];
+		}
+	}
+
+	//Shifting is linear, so each table entry is the sum of the shifted bits in it
+	unsigned char zeros[CRC32C_STRIDE];
+	uint32_t bits[32];
+	memset(zeros, 0, sizeof(zeros));
+	for(i = 0; i < 32; i++){
+		bits[i] = crc32c_bytes((uint32_t) 1 << i, zeros, CRC32C_STRIDE);
+	}
+	for(k = 0; k < 4; k++){
+		for(i = 0; i < 256; i++){
+			uint32_t shifted = 0;
+			int bit = 0;
+			for(bit = 0; bit < 8; bit++){
+				if(i & (1 << bit)){
+					shifted ^= bits[8 * k + bit];
+				}
+			}
+			crc32c_stride[k][i] = shifted;
+		}
+	}
+
+	crc32c_impl = crc32c_sliced;
+	crc32c_blocks_impl = crc32c_each;
+	crc32c_kind = "slicing-by-8";
+#if defined(__x86_64__) && defined(__GNUC__)
+	if(__builtin_cpu_supports("sse4.2")){
+		crc32c_impl = crc32c_sse42;
+		crc32c_blocks_impl = crc32c_each_sse42;
+		crc32c_kind = "SSE4.2, 3 streams";
+	}
+#endif
+}
+
+//Stand in for crc32c_impl and crc32c_blocks_impl until crc32c_init has run
+static uint32_t crc32c_resolve(uint32_t crc, const unsigned char* data, size_t len){
+	crc32c_init();
+	return crc32c_impl(crc, data, len);
+}
+
+static void crc32c_resolve_blocks(const unsigned char* const* blocks, long count, uint32_t* crcs){
+	crc32c_init();
+	crc32c_blocks_impl(blocks, count, crcs);
+}
+
+//CRC32C of len bytes, carrying on from crc (0 to start)
+static inline uint32_t crc32c(uint32_t crc, const void* data, size_t len){
+	return ~crc32c_impl(~crc, data, len);
+}
+
+//crc32c(0, block, BLOCK_SIZE) of each of count blocks, wherever they are,
+//into crcs.  Quicker than one at a time when there are a few.
+static inline void crc32c_blocks(const unsigned char* const* blocks, long count, uint32_t* crcs){
+	crc32c_blocks_impl(blocks, count, crcs);
+}
+
+//Compressed bytes in packed extents are a run of sequences, each a token byte,
+//then literals copied as they are, then a match: bytes copied from earlier in
+//the output.  The token's high four bits are the number of literals and its
+//low four the match length less LZ_MIN_MATCH; 15 in either means the value
+//goes on in the bytes after the token (literals) or after the offset (match),
+//each adding its own value, for as long as they are 255.  The match is given
+//as a two-byte little-endian offset back from where the output is.  The last
+//sequence has literals only and ends the input.
+#define LZ_MIN_MATCH 4
+#define LZ_HASH_BITS 12
+
+//Append a length that didn't fit in its four bits of the token
+static inline long lz_put_length(unsigned char* dst, long op, long cap, long length){
+	while(length >= 255){
+		if(op >= cap){
+			return -1;
+		}
+		dst[op++] = 255;
+		length -= 255;
+	}
+	if(op >= cap){
+		return -1;
+	}
+	dst[op++] = length;
+	return op;
+}
+
+//Append a sequence: nlit literals, then a match of mlen bytes offset bytes back
+//(none if mlen is 0).  Returns where the output is now, or -1 if it won't fit.
+static inline long lz_put_sequence(unsigned char* dst, long op, long cap, const unsigned char* lit, long nlit, long offset, long mlen){
+	long mcode = mlen ? mlen - LZ_MIN_MATCH : 0;
+	if(op >= cap){
+		return -1;
+	}
+	dst[op++] = ((nlit < 15 ? nlit : 15) << 4) | (mcode < 15 ? mcode : 15);
+	if(nlit >= 15 && (op = lz_put_length(dst, op, cap, nlit - 15)) < 0){
+		return -1;
+	}
+	if(nlit > cap - op){
+		return -1;
+	}
+	memcpy(dst + op, lit, nlit);
+	op += nlit;
+	if(mlen == 0){
+		return op;
+	}
+
+	if(cap - op < 2){
+		return -1;
+	}
+	dst[op++] = offset & 0xff;
+	dst[op++] = offset >> 8;
+	if(mcode >= 15){
+		op = lz_put_length(dst, op, cap, mcode - 15);
+	}
+	return op;
+}
+
+//Compress n bytes of src into dst, which has room for cap bytes.  Matches are
+//found through a table of where each hash of four bytes was last seen.
+//Returns the compressed length, or 0 if it doesn't fit in cap.
+static inline long lz_compress(const void* src_data, long n, void* dst_data, long cap){
+	const unsigned char* src = src_data;
+	unsigned char* dst = dst_data;
+	long seen[1 << LZ_HASH_BITS];
+	long i = 0;
+	for(i = 0; i < (1 << LZ_HASH_BITS); i++){
+		seen[i] = -1;
+	}
+
+	long op = 0;
+	long anchor = 0; //Start of the literals not written yet
+	long ip = 0;
+	while(ip + LZ_MIN_MATCH <= n){
+		uint32_t word;
+		memcpy(&word, src + ip, sizeof(uint32_t));
+		uint32_t hash = (word * 2654435761u) >> (32 - LZ_HASH_BITS);
+		long candidate = seen[hash];
+		seen[hash] = ip;
+		if(candidate < 0 || ip - candidate > 0xffff || memcmp(src + candidate, src + ip, LZ_MIN_MATCH) != 0){
+			ip++;
+			continue;
+		}
+
+		long mlen = LZ_MIN_MATCH;
+		while(ip + mlen < n && src[candidate + mlen] == src[ip + mlen]){
+			mlen++;
+		}
+		op = lz_put_sequence(dst, op, cap, src + anchor, ip - anchor, ip - candidate, mlen);
+		if(op < 0){
+			return 0;
+		}
+		ip += mlen;
+		anchor = ip;
+	}
+
+	op = lz_put_sequence(dst, op, cap, src + anchor, n - anchor, 0, 0);
+	return (op < 0) ? 0 : op;
+}
+
+//Decompress len bytes of src into exactly n bytes of dst.  Returns 0, or -1
+//if src is damaged or doesn't come to n bytes.
+static inline int lz_decompress(const void* src_data, long len, void* dst_data, long n){
+	const unsigned char* src = src_data;
+	unsigned char* dst = dst_data;
+	long ip = 0;
+	long op = 0;
+	while(ip < len){
+		int token = src[ip++];
+		long nlit = token >> 4;
+		if(nlit == 15){
+			int more = 255;
+			while(more == 255){
+				if(ip >= len){
+					return -1;
+				}
+				more = src[ip++];
+				nlit += more;
+			}
+		}
+		if(nlit > len - ip || nlit > n - op){
+			return -1;
+		}
+		memcpy(dst + op, src + ip, nlit);
+		ip += nlit;
+		op += nlit;
+		if(ip == len){ //Literals only: the last sequence
+			break;
+		}
+
+		if(len - ip < 2){
+			return -1;
+		}
+		long offset = src[ip] | (src[ip + 1] << 8);
+		ip += 2;
+		long mlen = (token & 15) + LZ_MIN_MATCH;
+		if((token & 15) == 15){
+			int more = 255;
+			while(more == 255){
+				if(ip >= len){
+					return -1;
+				}
+				more = src[ip++];
+				mlen += more;
+			}
+		}
+		if(offset == 0 || offset > op || mlen > n - op){
+			return -1;
+		}
+		//The match may overlap what it makes.  From 8 bytes back on it can go 8
+		//bytes at a time (spilling up to 7 past the match, which comes next).
+		unsigned char* out = dst + op;
+		long k = 0;
+		if(offset >= 8 && mlen + 7 <= n - op){
+			for(k = 0; k < mlen; k += 8){
+				memcpy(out + k, out + k - offset, 8);
+			}
+		} else{
+			for(k = 0; k < mlen; k++){
+				out[k] = out[k - offset];
+			}
+		}
+		op += mlen;
+	}
+	return (op == n) ? 0 : -1;
+}
+
+#endif
@@ -0,0 +1,594 @@
+/*
+	cs1550_mkfs: build a ready-to-mount cs1550 disk image from a directory on
+	the host, without going through FUSE.
+
+	gcc -Wall -o cs1550_mkfs cs1550_mkfs.c
+	./cs1550_mkfs [-s size] [-n] source [image]	(.disk if no image is given)
+
+	source holds the directories of the new filesystem, and each of those holds
+	its files, all with names that fit 8.3.  The image is laid out before any of
+	it is written: superblock, FAT and root first, then each directory's blocks
+	followed by its files, one contiguous run each.  A directory with more files
+	than one block holds gets its chain of blocks and its index built in one go,
+	leaves packed full in hash order.  Everything then goes out in a single
+	front-to-back pass of large writes, checksummed on the way, and the
+	checksum table goes in last; -n leaves the table out, for an image that
+	is only ever mounted with -o mmap.  size takes a K, M or G suffix;
+	without one the image is 5M, or as big as the tree needs if that is more.
+*/
+
+#define _FILE_OFFSET_BITS 64
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+
+#include "cs1550_fs.h"
+
+//Image size when -s isn't given, the same as the usual dd'd .disk
+#define DEFAULT_IMAGE_BYTES (5 * 1024 * 1024)
+
+//Blocks gathered in memory before each write to the image
+#define WRITE_BLOCKS 2048
+
+//A file to import and where it goes
+struct import_file {
+	char fname[MAX_FILENAME + 1];
+	char fext[MAX_EXTENSION + 1];
+	size_t size;
+	long blocks;		//At least one, as the driver gives every file a block
+	long start;
+};
+
+//A directory to import
+struct import_dir {
+	char dname[MAX_FILENAME + 1];
+	char path[PATH_MAX];
+	struct import_file* files;	//In name order
+	int nfiles;
+	long block;		//Its first block
+	long heap;		//Blocks of entries in its chain
+	long nodes;		//Blocks in its index; 0 if it fits in one block
+	cs1550_directory_entry* entries;	//heap of them
+	cs1550_dir_node* index;	//nodes of them, root last
+};
+
+//Blocks on their way to the image, written out strictly in order
+struct image_writer {
+	int fd;
+	char* buf;
+	long fill;		//Blocks waiting in buf
+	long next;		//Block the first of them goes to
+	uint32_t* checksums;	//The checksum table, filled in as blocks go out
+};
+
+//Write count blocks starting at block
+static int write_blocks(int fd, long block, long count, const void* data){
+	size_t len = count * BLOCK_SIZE;
+	size_t done = 0;
+	while(done < len){
+		ssize_t put = pwrite(fd, (const char*) data + done, len - done, (off_t) block * BLOCK_SIZE + done);
+		if(put < 0 && errno == EINTR){
+			continue;
+		}
+		if(put <= 0){
+			return put < 0 ? -errno : -EIO;
+		}
+		done += put;
+	}
+	return 0;
+}
+
+static int writer_flush(struct image_writer* w){
+	long i = 0;
+	for(i = (w->next == 0) ? 1 : 0; i < w->fill && w->checksums != NULL; i++){ //Not the superblock
+		w->checksums[w->next + i] = crc32c(0, w->buf + i * BLOCK_SIZE, BLOCK_SIZE);
+	}
+	int res = write_blocks(w->fd, w->next, w->fill, w->buf);
+	w->next += w->fill;
+	w->fill = 0;
+	return res;
+}
+
+//Leave the next count blocks of the image as they are (zeros, after the truncate)
+static int writer_skip(struct image_writer* w, long count){
+	int res = writer_flush(w);
+	w->next += count;
+	return res;
+}
+
+//Queue count blocks of data for the next blocks of the image
+static int writer_put(struct image_writer* w, const void* data, long count){
+	while(count > 0){
+		long n = WRITE_BLOCKS - w->fill;
+		if(n > count){
+			n = count;
+		}
+		memcpy(w->buf + w->fill * BLOCK_SIZE, data, n * BLOCK_SIZE);
+		w->fill += n;
+		data = (const char*) data + n * BLOCK_SIZE;
+		count -= n;
+		if(w->fill == WRITE_BLOCKS){
+			int res = writer_flush(w);
+			if(res != 0){
+				return res;
+			}
+		}
+	}
+	return 0;
+}
+
+//Copy a host file into the next blocks of the image, reading it straight into
+//the write buffer and zero-filling its last block
+static int writer_put_file(struct image_writer* w, const char* path, const struct import_file* file){
+	int fd = open(path, O_RDONLY);
+	if(fd < 0){
+		return -errno;
+	}
+	posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+	int res = 0;
+	size_t left = file->size;
+	long blocks = file->blocks;
+	while(blocks > 0 && res == 0){
+		long n = WRITE_BLOCKS - w->fill;
+		if(n > blocks){
+			n = blocks;
+		}
+		char* dst = w->buf + w->fill * BLOCK_SIZE;
+		size_t want = (size_t) n * BLOCK_SIZE < left ? (size_t) n * BLOCK_SIZE : left;
+		size_t got = 0;
+		while(got < want){
+			ssize_t r = read(fd, dst + got, want - got);
+			if(r < 0 && errno == EINTR){
+				continue;
+			}
+			if(r <= 0){ //Shrank since it was measured
+				res = (r < 0) ? -errno : -EAGAIN;
+				break;
+			}
+			got += r;
+		}
+		memset(dst + got, 0, n * BLOCK_SIZE - got);
+		left -= got;
+		blocks -= n;
+		w->fill += n;
+		if(res == 0 && w->fill == WRITE_BLOCKS){
+			res = writer_flush(w);
+		}
+	}
+
+	close(fd);
+	return res;
+}
+
+//Parse a size like 5242880, 512K, 20M or 1G
+static long long parse_size(const char* arg){
+	char* end = NULL;
+	long long size = strtoll(arg, &end, 10);
+	switch(*end){
+		case 'k': case 'K': size <<= 10; end++; break;
+		case 'm': case 'M': size <<= 20; end++; break;
+		case 'g': case 'G': size <<= 30; end++; break;
+	}
+	return (end == arg || *end != '\0' || size <= 0) ? -1 : size;
+}
+
+//Split a host file name into 8.3 parts, the same way the driver does
+static int split_name(const char* name, char* fname, char* fext){
+	const char* dot = strchr(name, '.');
+	const char* name_end = dot ? dot : name + strlen(name);
+	if(name_end == name || (dot && dot[1] == '\0') || name_end - name > MAX_FILENAME || (dot && strlen(dot + 1) > MAX_EXTENSION)){
+		return -ENAMETOOLONG;
+	}
+	memcpy(fname, name, name_end - name);
+	fname[name_end - name] = '\0';
+	strcpy(fext, dot ? dot + 1 : "");
+	return 0;
+}
+
+static int skip_entry(const struct dirent* ent){
+	return strcmp(ent->d_name, ".") != 0 && strcmp(ent->d_name, "..") != 0;
+}
+
+//Read the source tree into dirs, checking it fits the filesystem's limits.
+//Entries are taken in name order so the same tree always gives the same image.
+static int scan_tree(const char* source, struct import_dir* dirs, int* ndirs){
+	struct dirent** top = NULL;
+	int ntop = scandir(source, &top, skip_entry, alphasort);
+	if(ntop < 0){
+		fprintf(stderr, "cs1550_mkfs: %s: %s\n", source, strerror(errno));
+		return -1;
+	}
+
+	int res = 0;
+	int i = 0;
+	*ndirs = 0;
+	for(i = 0; i < ntop && res == 0; i++){
+		struct import_dir* dir = &dirs[*ndirs];
+		struct stat st;
+		snprintf(dir->path, sizeof(dir->path), "%s/%s", source, top[i]->d_name);
+		if(stat(dir->path, &st) != 0 || !S_ISDIR(st.st_mode)){
+			fprintf(stderr, "cs1550_mkfs: %s: only directories can go in the root\n", dir->path);
+			res = -1;
+			break;
+		}
+		if(strlen(top[i]->d_name) > MAX_FILENAME || strchr(top[i]->d_name, '.') != NULL){
+			fprintf(stderr, "cs1550_mkfs: %s: directory names are at most %d characters with no extension\n", dir->path, MAX_FILENAME);
+			res = -1;
+			break;
+		}
+		if(*ndirs >= (int) (MAX_DIRS_IN_ROOT)){
+			fprintf(stderr, "cs1550_mkfs: %s: more than %d directories\n", source, (int) (MAX_DIRS_IN_ROOT));
+			res = -1;
+			break;
+		}
+		strcpy(dir->dname, top[i]->d_name);
+		dir->files = NULL;
+		dir->nfiles = 0;
+
+		struct dirent** ents = NULL;
+		int nents = scandir(dir->path, &ents, skip_entry, alphasort);
+		if(nents < 0){
+			fprintf(stderr, "cs1550_mkfs: %s: %s\n", dir->path, strerror(errno));
+			res = -1;
+			break;
+		}
+		int j = 0;
+		dir->files = malloc((nents ? nents : 1) * sizeof(struct import_file));
+		if(dir->files == NULL){
+			fprintf(stderr, "cs1550_mkfs: out of memory\n");
+			res = -1;
+		}
+		for(j = 0; j < nents; j++){
+			char path[PATH_MAX];
+			struct import_file* file = &dir->files[dir->nfiles];
+			snprintf(path, sizeof(path), "%s/%s", dir->path, ents[j]->d_name);
+			if(res == 0 && (stat(path, &st) != 0 || !S_ISREG(st.st_mode))){
+				fprintf(stderr, "cs1550_mkfs: %s: not a regular file\n", path);
+				res = -1;
+			}
+			if(res == 0 && split_name(ents[j]->d_name, file->fname, file->fext) != 0){
+				fprintf(stderr, "cs1550_mkfs: %s: not an 8.3 name\n", path);
+				res = -1;
+			}
+			if(res == 0){
+				file->size = st.st_size;
+				file->blocks = (st.st_size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+				if(file->blocks == 0){
+					file->blocks = 1;
+				}
+				dir->nfiles++;
+			}
+			free(ents[j]);
+		}
+		free(ents);
+		(*ndirs)++;
+	}
+
+	for(i = 0; i < ntop; i++){
+		free(top[i]);
+	}
+	free(top);
+	return res;
+}
+
+//Work out how many blocks of entries and of index a directory needs
+static void plan_dir(struct import_dir* dir){
+	dir->heap = 1;
+	dir->nodes = 0;
+	if(dir->nfiles <= (int) (MAX_FILES_IN_DIR)){
+		return;
+	}
+	dir->heap = (dir->nfiles + (MAX_FILES_IN_DIR) - 1) / (MAX_FILES_IN_DIR);
+	long level = (dir->heap * (MAX_FILES_IN_DIR) + DIR_LEAF_ENTRIES - 1) / DIR_LEAF_ENTRIES; //Every slot has a key, free ones too
+	dir->nodes = level;
+	while(level > 1){
+		level = (level + DIR_NODE_ENTRIES - 1) / DIR_NODE_ENTRIES;
+		dir->nodes += level;
+	}
+}
+
+static int compare_names(const void* a, const void* b){
+	const struct cs1550_dir_name* x = a;
+	const struct cs1550_dir_name* y = b;
+	if(x->hash != y->hash){
+		return (x->hash < y->hash) ? -1 : 1;
+	}
+	if(x->block != y->block){
+		return (x->block < y->block) ? -1 : 1;
+	}
+	return (x->slot < y->slot) ? -1 : (x->slot > y->slot);
+}
+
+//Where node n of a directory's index goes: the root is second in the
+//directory's chain, and the rest follow the chain in the order they were built
+static long node_block(const struct import_dir* dir, long n){
+	return (n == dir->nodes - 1) ? dir->block + 1 : dir->block + dir->heap + 1 + n;
+}
+
+//Where heap block h of a directory goes: the first heads the chain, and the
+//rest come after the root of the index
+static long heap_block(const struct import_dir* dir, long h){
+	return (h == 0 || dir->nodes == 0) ? dir->block + h : dir->block + 1 + h;
+}
+
+//Build a directory's index bottom up: full leaves over every slot in hash
+//order, then levels of inner nodes over them until one node is left for the root
+static int build_index(struct import_dir* dir){
+	long nkeys = dir->heap * (MAX_FILES_IN_DIR);
+	struct cs1550_dir_name* keys = malloc(nkeys * sizeof(struct cs1550_dir_name));
+	uint32_t* low = malloc(dir->nodes * sizeof(uint32_t)); //Lowest hash under each node
+	dir->index = calloc(dir->nodes, sizeof(cs1550_dir_node));
+	if(keys == NULL || low == NULL || dir->index == NULL){
+		free(keys);
+		free(low);
+		return -ENOMEM;
+	}
+
+	long k = 0;
+	for(k = 0; k < nkeys; k++){
+		keys[k].hash = (k < dir->nfiles) ? dir_hash(dir->files[k].fname, dir->files[k].fext) : DIR_HASH_FREE;
+		keys[k].block = heap_block(dir, k / (MAX_FILES_IN_DIR));
+		keys[k].slot = k % (MAX_FILES_IN_DIR);
+	}
+	qsort(keys, nkeys, sizeof(struct cs1550_dir_name), compare_names);
+
+	long level_start = 0;
+	long level_count = (nkeys + DIR_LEAF_ENTRIES - 1) / DIR_LEAF_ENTRIES;
+	long n = 0;
+	for(n = 0; n < level_count; n++){
+		cs1550_dir_node* leaf = &dir->index[n];
+		leaf->magic = DIR_NODE_MAGIC;
+		leaf->count = (nkeys - n * DIR_LEAF_ENTRIES < (long) DIR_LEAF_ENTRIES) ? nkeys - n * DIR_LEAF_ENTRIES : DIR_LEAF_ENTRIES;
+		leaf->next = (n + 1 < level_count) ? node_block(dir, n + 1) : 0;
+		memcpy(leaf->names, &keys[n * DIR_LEAF_ENTRIES], leaf->count * sizeof(struct cs1550_dir_name));
+		low[n] = leaf->names[0].hash;
+	}
+
+	uint32_t depth = 0;
+	while(level_count > 1){
+		long parent_start = level_start + level_count;
+		long parents = (level_count + DIR_NODE_ENTRIES - 1) / DIR_NODE_ENTRIES;
+		depth++;
+		for(n = 0; n < parents; n++){
+			cs1550_dir_node* node = &dir->index[parent_start + n];
+			node->magic = DIR_NODE_MAGIC;
+			node->depth = depth;
+			long first = level_start + n * DIR_NODE_ENTRIES;
+			long c = 0;
+			for(c = 0; c < (long) DIR_NODE_ENTRIES && first + c < parent_start; c++){
+				node->children[c].hash = low[first + c];
+				node->children[c].block = node_block(dir, first + c);
+			}
+			node->count = c;
+			low[parent_start + n] = low[first];
+		}
+		level_start = parent_start;
+		level_count = parents;
+	}
+
+	free(keys);
+	free(low);
+	return 0;
+}
+
+//Fill in the superblock for an image of nblocks blocks, with a checksum table
+//unless csum is 0
+static void plan_layout(cs1550_disk_superblock* disk_sb, long nblocks, int csum){
+	memset(disk_sb, 0, sizeof(cs1550_disk_superblock));
+	disk_sb->magic = CS1550_MAGIC;
+	disk_sb->version = CS1550_VERSION;
+	disk_sb->block_size = BLOCK_SIZE;
+	disk_sb->nblocks = nblocks;
+	disk_sb->fat_start = 1;
+	disk_sb->fat_blocks = (nblocks + FAT_ENTRIES_PER_BLOCK - 1) / FAT_ENTRIES_PER_BLOCK;
+	disk_sb->journal_start = disk_sb->fat_start + disk_sb->fat_blocks;
+	disk_sb->journal_blocks = JOURNAL_DEFAULT_BLOCKS(nblocks);
+	disk_sb->csum_start = disk_sb->journal_start + disk_sb->journal_blocks;
+	disk_sb->csum_blocks = csum ? CSUM_BLOCKS(nblocks) : 0;
+	disk_sb->root_block = disk_sb->csum_start + disk_sb->csum_blocks;
+	disk_sb->data_start = disk_sb->root_block + 1;
+}
+
+int main(int argc, char* argv[]){
+	long long image_bytes = -1;
+	int csum = 1;
+	int opt = 0;
+	while((opt = getopt(argc, argv, "s:n")) != -1){
+		if(opt == 'n'){
+			csum = 0;
+		} else if(opt != 's' || (image_bytes = parse_size(optarg)) < 0){
+			fprintf(stderr, "usage: %s [-s size] [-n] source [image]\n", argv[0]);
+			return 2;
+		}
+	}
+	if(optind >= argc || argc - optind > 2){
+		fprintf(stderr, "usage: %s [-s size] [-n] source [image]\n", argv[0]);
+		return 2;
+	}
+	const char* source = argv[optind];
+	const char* image = (argc - optind > 1) ? argv[optind + 1] : ".disk";
+	crc32c_init();
+
+	struct timeval started;
+	gettimeofday(&started, NULL);
+
+	int ndirs = 0;
+	struct import_dir* dirs = calloc(MAX_DIRS_IN_ROOT, sizeof(struct import_dir));
+	if(dirs == NULL || scan_tree(source, dirs, &ndirs) != 0){
+		return 1;
+	}
+
+	//Blocks the tree needs past the root, and so the smallest image it fits in
+	long long used = 0;
+	long long bytes = 0;
+	long files = 0;
+	int d = 0;
+	int f = 0;
+	for(d = 0; d < ndirs; d++){
+		plan_dir(&dirs[d]);
+		used += dirs[d].heap + dirs[d].nodes;
+		for(f = 0; f < dirs[d].nfiles; f++){
+			used += dirs[d].files[f].blocks;
+			bytes += dirs[d].files[f].size;
+			files++;
+		}
+	}
+	long long needed = used + 2;
+	long long prev = 0;
+	while(needed != prev){ //The FAT, the journal and the checksum table grow with the image they cover
+		prev = needed;
+		needed = used + 2 + (prev + FAT_ENTRIES_PER_BLOCK - 1) / FAT_ENTRIES_PER_BLOCK + JOURNAL_DEFAULT_BLOCKS(prev) + (csum ? CSUM_BLOCKS(prev) : 0);
+	}
+	if(image_bytes < 0){
+		image_bytes = (needed * BLOCK_SIZE > DEFAULT_IMAGE_BYTES) ? needed * BLOCK_SIZE : DEFAULT_IMAGE_BYTES;
+	}
+	long long nblocks = image_bytes / BLOCK_SIZE;
+	if(nblocks > FAT_HOLE){ //FAT entries are 32-bit, and the top ones flag holes
+		nblocks = FAT_HOLE;
+	}
+	if(nblocks < needed){
+		fprintf(stderr, "cs1550_mkfs: %s needs %lld blocks; %lld bytes only holds %lld\n", source, needed, image_bytes, nblocks);
+		return 1;
+	}
+
+	//Place everything and build the metadata before writing any of it
+	cs1550_disk_superblock disk_sb;
+	plan_layout(&disk_sb, nblocks, csum);
+	int32_t* fat = calloc(disk_sb.fat_blocks, BLOCK_SIZE);
+	cs1550_root_directory root;
+	struct image_writer w;
+	w.buf = malloc(WRITE_BLOCKS * BLOCK_SIZE);
+	w.checksums = csum ? calloc(disk_sb.csum_blocks, BLOCK_SIZE) : NULL;
+	if(fat == NULL || w.buf == NULL || (csum && w.checksums == NULL)){
+		fprintf(stderr, "cs1550_mkfs: out of memory\n");
+		return 1;
+	}
+	memset(&root, 0, sizeof(cs1550_root_directory));
+
+	long next = disk_sb.data_start;
+	for(d = 0; d < ndirs; d++){
+		struct import_dir* dir = &dirs[d];
+		dir->block = next;
+		dir->entries = calloc(dir->heap, sizeof(cs1550_directory_entry));
+		if(dir->entries == NULL || (dir->nodes > 0 && build_index(dir) != 0)){
+			fprintf(stderr, "cs1550_mkfs: out of memory\n");
+			return 1;
+		}
+		long chain = dir->heap + (dir->nodes > 0 ? 1 : 0);
+		long i = 0;
+		for(i = 0; i < chain - 1; i++){
+			fat[next + i] = next + i + 1;
+		}
+		fat[next + chain - 1] = EOF;
+		for(i = chain; i < dir->heap + dir->nodes; i++){ //The rest of the index
+			fat[next + i] = EOF;
+		}
+		next += dir->heap + dir->nodes;
+		strcpy(root.directories[d].dname, dir->dname);
+		root.directories[d].nStartBlock = dir->block;
+		root.nDirectories++;
+
+		for(f = 0; f < dir->nfiles; f++){
+			struct import_file* file = &dir->files[f];
+			file->start = next;
+			long i = 0;
+			for(i = 0; i < file->blocks - 1; i++){
+				fat[next + i] = next + i + 1;
+			}
+			fat[next + file->blocks - 1] = EOF;
+			next += file->blocks;
+
+			cs1550_directory_entry* entry = &dir->entries[f / (MAX_FILES_IN_DIR)];
+			struct cs1550_file_directory* slot = &entry->files[f % (MAX_FILES_IN_DIR)];
+			strcpy(slot->fname, file->fname);
+			strcpy(slot->fext, file->fext);
+			slot->fsize = file->size;
+			slot->nStartBlock = file->start;
+			entry->nFiles++;
+		}
+	}
+
+	//Then write it all in block order
+	w.fd = open(image, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if(w.fd < 0 || ftruncate(w.fd, nblocks * BLOCK_SIZE) != 0){
+		fprintf(stderr, "cs1550_mkfs: %s: %s\n", image, strerror(errno));
+		return 1;
+	}
+	w.fill = 0;
+	w.next = 0;
+
+	int res = writer_put(&w, &disk_sb, 1);
+	if(res == 0){
+		res = writer_put(&w, fat, disk_sb.fat_blocks);
+	}
+	if(res == 0){ //An all-zero journal is an empty one, and the checksum table comes last
+		res = writer_skip(&w, disk_sb.journal_blocks + disk_sb.csum_blocks);
+	}
+	if(res == 0){
+		res = writer_put(&w, &root, 1);
+	}
+	for(d = 0; d < ndirs && res == 0; d++){
+		const struct import_dir* dir = &dirs[d];
+		res = writer_put(&w, &dir->entries[0], 1);
+		if(res == 0 && dir->nodes > 0){ //Root, the rest of the chain, the rest of the index
+			res = writer_put(&w, &dir->index[dir->nodes - 1], 1);
+			if(res == 0){
+				res = writer_put(&w, &dir->entries[1], dir->heap - 1);
+			}
+			if(res == 0){
+				res = writer_put(&w, dir->index, dir->nodes - 1);
+			}
+		}
+		for(f = 0; f < dirs[d].nfiles && res == 0; f++){
+			char path[PATH_MAX];
+			const struct import_file* file = &dirs[d].files[f];
+			snprintf(path, sizeof(path), "%s/%s%s%s", dirs[d].path, file->fname, file->fext[0] ? "." : "", file->fext);
+			res = writer_put_file(&w, path, file);
+			if(res != 0){
+				fprintf(stderr, "cs1550_mkfs: %s: %s\n", path, res == -EAGAIN ? "changed while importing" : strerror(-res));
+			}
+		}
+	}
+	if(res == 0 && w.fill > 0){
+		res = writer_flush(&w);
+	}
+	if(res == 0 && csum){
+		res = write_blocks(w.fd, disk_sb.csum_start, disk_sb.csum_blocks, w.checksums);
+	}
+	if(res == 0 && fsync(w.fd) != 0){
+		res = -errno;
+	}
+	close(w.fd);
+	if(res != 0){
+		fprintf(stderr, "cs1550_mkfs: %s not written: %s\n", image, strerror(-res));
+		unlink(image);
+		return 1;
+	}
+
+	struct timeval finished;
+	gettimeofday(&finished, NULL);
+	double seconds = (finished.tv_sec - started.tv_sec) + (finished.tv_usec - started.tv_usec) / 1e6;
+	printf("%s: %d directories, %ld files, %lld bytes in %lld of %lld blocks; %.2f s, %.1f MB/s\n",
+		image, ndirs, files, bytes, used, nblocks, seconds, seconds > 0 ? bytes / seconds / (1024 * 1024) : 0.0);
+
+	for(d = 0; d < ndirs; d++){
+		free(dirs[d].files);
+		free(dirs[d].entries);
+		free(dirs[d].index);
+	}
+	free(fat);
+	free(dirs);
+	free(w.buf);
+	free(w.checksums);
+	return 0;
+}
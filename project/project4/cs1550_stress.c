@@ -0,0 +1,350 @@
+/*
+	cs1550_stress: hammer the cs1550 driver with concurrent readers and writers
+	and check that every byte comes back the way it was written.
+
+	gcc -Wall -O2 -o cs1550_stress cs1550_stress.c `pkg-config fuse --cflags --libs` -lpthread
+	./cs1550_stress [-t threads] [-n ops] [-s size] [-o options]
+
+	The driver is compiled in and its operations are called straight from the
+	threads, the way FUSE's multithreaded loop would call them, on a fresh image
+	in a scratch directory.  -o takes the driver's own mount options (journal,
+	compress, alloc=bitmap, ...).  Each thread owns a few files in directories
+	every thread creates and deletes files in, and keeps its own copy of what
+	they should hold; all of them also read a set of shared files the whole
+	time.  At the end the image is unmounted, mounted again and every file
+	checked once more.  Build it with -fsanitize=thread to check the locking.
+*/
+
+#define main cs1550_main
+#include "cs1550_1.c"
+#undef main
+
+#include <sys/time.h>
+
+//Directories the threads' files are spread over, and files each thread owns
+#define STRESS_DIRS 4
+#define STRESS_FILES 4
+
+//Shared files everyone reads, and the largest any file gets
+#define SHARED_FILES 8
+#define MAX_FILE_BYTES (96 * 1024)
+
+//What main() handed to fuse_main: the operations and the mount
+static const struct fuse_operations* ops;
+static struct fuse_context context;
+
+struct fuse_context* fuse_get_context(void){
+	return &context;
+}
+
+int fuse_main_real(int argc, char* argv[], const struct fuse_operations* op, size_t op_size, void* user_data){
+	(void) argc;
+	(void) argv;
+	(void) op_size;
+	ops = op;
+	context.private_data = user_data;
+	return 0;
+}
+
+//A file a thread owns and what should be in it
+struct owned_file {
+	char path[32];
+	int exists;
+	size_t size;
+	char* data;
+};
+
+struct worker {
+	pthread_t thread;
+	int id;
+	unsigned int seed;
+	long ops;
+	long failures;
+	struct owned_file files[STRESS_FILES];
+};
+
+static long ops_per_thread = 2000;
+static char* shared_data; //SHARED_FILES files of MAX_FILE_BYTES, back to back
+
+//Mount .disk in the current directory with the driver's options
+static int stress_mount(const char* options){
+	char* args[] = { "cs1550", "-o", (char*) options, "mnt", NULL };
+	return cs1550_main(4, args);
+}
+
+static void stress_unmount(void){
+	ops->destroy(context.private_data);
+	context.private_data = NULL;
+}
+
+//Bytes that go at offset in a file, for a write tagged with stamp
+static char pattern(unsigned int stamp, off_t offset){
+	return (char) ((stamp * 2654435761u + (unsigned int) offset * 40503u) >> 13);
+}
+
+//Note a failure and say what it was
+static void fail(struct worker* w, const char* what, const char* path, long got){
+	w->failures++;
+	fprintf(stderr, "cs1550_stress: thread %d: %s %s (%ld)\n", w->id, what, path, got);
+}
+
+//Read a whole file and compare it with what it should hold
+static void check_file(struct worker* w, const char* path, const char* want, size_t size){
+	struct stat st;
+	int res = ops->getattr(path, &st);
+	if(res != 0 || (size_t) st.st_size != size){
+		fail(w, "wrong size for", path, res ? res : (long) st.st_size);
+		return;
+	}
+
+	struct fuse_file_info fi;
+	memset(&fi, 0, sizeof(struct fuse_file_info));
+	char* buf = malloc(MAX_FILE_BYTES + 1);
+	res = ops->open(path, &fi);
+	if(res != 0){
+		fail(w, "can't open", path, res);
+	} else{
+		int got = ops->read(path, buf, MAX_FILE_BYTES + 1, 0, &fi);
+		if(got != (int) size || memcmp(buf, want, size) != 0){
+			fail(w, "wrong data in", path, got);
+		}
+		ops->release(path, &fi);
+	}
+	free(buf);
+}
+
+//Write a random stretch of one of the thread's files (creating it if need be)
+static void write_file(struct worker* w, struct owned_file* f){
+	int res = 0;
+	if(!f->exists){
+		res = ops->mknod(f->path, S_IFREG | 0644, 0);
+		if(res != 0){
+			fail(w, "can't create", f->path, res);
+			return;
+		}
+		f->exists = 1;
+		f->size = 0;
+	}
+
+	off_t offset = rand_r(&w->seed) % (MAX_FILE_BYTES / 2);
+	size_t len = 1 + rand_r(&w->seed) % (MAX_FILE_BYTES / 2);
+	unsigned int stamp = rand_r(&w->seed);
+	char* buf = malloc(len);
+	size_t i = 0;
+	for(i = 0; i < len; i++){
+		buf[i] = pattern(stamp, offset + i);
+	}
+
+	//Sometimes in pieces, which the write buffer collects
+	struct fuse_file_info fi;
+	memset(&fi, 0, sizeof(struct fuse_file_info));
+	res = ops->open(f->path, &fi);
+	size_t done = 0;
+	size_t piece = (rand_r(&w->seed) % 2) ? len : 700;
+	while(res == 0 && done < len){
+		size_t n = (len - done < piece) ? len - done : piece;
+		int wrote = ops->write(f->path, buf + done, n, offset + done, &fi);
+		if(wrote != (int) n){
+			res = (wrote < 0) ? wrote : -EIO;
+			break;
+		}
+		done += n;
+	}
+	if(res == 0 && rand_r(&w->seed) % 8 == 0){
+		res = ops->fsync(f->path, 0, &fi);
+	}
+	if(res == 0){
+		res = ops->flush(f->path, &fi);
+		ops->release(f->path, &fi);
+	}
+	if(res != 0){
+		fail(w, "can't write", f->path, res);
+		free(buf);
+		return;
+	}
+
+	if((size_t) offset > f->size){ //Skipped over: reads as zeros
+		memset(f->data + f->size, 0, offset - f->size);
+	}
+	memcpy(f->data + offset, buf, len);
+	if(offset + len > f->size){
+		f->size = offset + len;
+	}
+	free(buf);
+}
+
+static void* worker_run(void* arg){
+	struct worker* w = arg;
+	long n = 0;
+	for(n = 0; n < ops_per_thread; n++){
+		struct owned_file* f = &w->files[rand_r(&w->seed) % STRESS_FILES];
+		int op = rand_r(&w->seed) % 10;
+		int res = 0;
+		if(op < 3){
+			write_file(w, f);
+		} else if(op < 5 && f->exists){
+			check_file(w, f->path, f->data, f->size);
+		} else if(op == 5 && f->exists){
+			size_t size = rand_r(&w->seed) % MAX_FILE_BYTES;
+			res = ops->truncate(f->path, size);
+			if(res != 0){
+				fail(w, "can't truncate", f->path, res);
+			} else{
+				if(size > f->size){
+					memset(f->data + f->size, 0, size - f->size);
+				}
+				f->size = size;
+			}
+		} else if(op == 6 && f->exists){
+			res = ops->unlink(f->path);
+			if(res != 0){
+				fail(w, "can't unlink", f->path, res);
+			}
+			f->exists = 0;
+		} else{ //Everyone reads the shared files
+			int k = rand_r(&w->seed) % SHARED_FILES;
+			char path[32];
+			snprintf(path, sizeof(path), "/shared/f%d.dat", k);
+			check_file(w, path, shared_data + k * MAX_FILE_BYTES, MAX_FILE_BYTES);
+		}
+		w->ops++;
+	}
+	return NULL;
+}
+
+static double seconds_since(const struct timeval* start){
+	struct timeval now;
+	gettimeofday(&now, NULL);
+	return (now.tv_sec - start->tv_sec) + (now.tv_usec - start->tv_usec) / 1e6;
+}
+
+int main(int argc, char* argv[]){
+	int nthreads = 8;
+	long long image_mb = 64;
+	const char* options = "cache_blocks=256";
+	int opt = 0;
+	while((opt = getopt(argc, argv, "t:n:s:o:")) != -1){
+		if(opt == 't'){
+			nthreads = atoi(optarg);
+		} else if(opt == 'n'){
+			ops_per_thread = atol(optarg);
+		} else if(opt == 's'){
+			image_mb = atoll(optarg);
+		} else if(opt == 'o'){
+			options = optarg;
+		} else{
+			nthreads = 0;
+		}
+	}
+	if(nthreads <= 0 || ops_per_thread <= 0 || image_mb <= 0 || optind != argc){
+		fprintf(stderr, "usage: %s [-t threads] [-n ops] [-s size in MB] [-o options]\n", argv[0]);
+		return 2;
+	}
+
+	//A blank image in a scratch directory, which the driver formats at mount
+	char scratch[] = "cs1550_stress.XXXXXX";
+	if(mkdtemp(scratch) == NULL || chdir(scratch) != 0){
+		perror("cs1550_stress");
+		return 1;
+	}
+	int fd = open(".disk", O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if(fd < 0 || ftruncate(fd, image_mb * 1024 * 1024) != 0){
+		perror("cs1550_stress: .disk");
+		return 1;
+	}
+	close(fd);
+	if(stress_mount(options) != 0 || ops == NULL){
+		fprintf(stderr, "cs1550_stress: mount failed\n");
+		return 1;
+	}
+
+	//Directories, and the shared files before anyone reads them
+	struct worker setup;
+	memset(&setup, 0, sizeof(struct worker));
+	setup.id = -1;
+	char path[32];
+	int d = 0;
+	for(d = 0; d < STRESS_DIRS; d++){
+		snprintf(path, sizeof(path), "/d%d", d);
+		ops->mkdir(path, 0755);
+	}
+	ops->mkdir("/shared", 0755);
+	shared_data = malloc((size_t) SHARED_FILES * MAX_FILE_BYTES);
+	int k = 0;
+	for(k = 0; k < SHARED_FILES; k++){
+		snprintf(path, sizeof(path), "/shared/f%d.dat", k);
+		char* data = shared_data + k * MAX_FILE_BYTES;
+		off_t i = 0;
+		for(i = 0; i < MAX_FILE_BYTES; i++){
+			data[i] = pattern(k, i);
+		}
+		struct fuse_file_info fi;
+		memset(&fi, 0, sizeof(struct fuse_file_info));
+		if(ops->mknod(path, S_IFREG | 0644, 0) != 0 || ops->open(path, &fi) != 0
+				|| ops->write(path, data, MAX_FILE_BYTES, 0, &fi) != MAX_FILE_BYTES || ops->flush(path, &fi) != 0){
+			fprintf(stderr, "cs1550_stress: can't write %s\n", path);
+			return 1;
+		}
+		ops->release(path, &fi);
+	}
+
+	struct worker* workers = calloc(nthreads, sizeof(struct worker));
+	int t = 0;
+	for(t = 0; t < nthreads; t++){
+		workers[t].id = t;
+		workers[t].seed = 1000 + t;
+		for(k = 0; k < STRESS_FILES; k++){
+			snprintf(workers[t].files[k].path, sizeof(workers[t].files[k].path), "/d%d/t%df%d.dat", (t + k) % STRESS_DIRS, t, k);
+			workers[t].files[k].data = malloc(MAX_FILE_BYTES);
+		}
+	}
+
+	struct timeval start;
+	gettimeofday(&start, NULL);
+	for(t = 0; t < nthreads; t++){
+		pthread_create(&workers[t].thread, NULL, worker_run, &workers[t]);
+	}
+	long total = 0;
+	long failures = 0;
+	for(t = 0; t < nthreads; t++){
+		pthread_join(workers[t].thread, NULL);
+		total += workers[t].ops;
+		failures += workers[t].failures;
+	}
+	double elapsed = seconds_since(&start);
+	printf("%d threads, %ld operations in %.2f s (%.0f/s), %ld failures\n", nthreads, total, elapsed, total / elapsed, failures);
+
+	//Everything has to survive an unmount and mount too
+	stress_unmount();
+	if(stress_mount(options) != 0){
+		fprintf(stderr, "cs1550_stress: mount failed\n");
+		return 1;
+	}
+	for(t = 0; t < nthreads; t++){
+		for(k = 0; k < STRESS_FILES; k++){
+			struct owned_file* f = &workers[t].files[k];
+			struct stat st;
+			if(f->exists){
+				check_file(&workers[t], f->path, f->data, f->size);
+			} else if(ops->getattr(f->path, &st) != -ENOENT){
+				fail(&workers[t], "still there after unlink:", f->path, 0);
+			}
+		}
+	}
+	for(k = 0; k < SHARED_FILES; k++){
+		snprintf(path, sizeof(path), "/shared/f%d.dat", k);
+		check_file(&setup, path, shared_data + k * MAX_FILE_BYTES, MAX_FILE_BYTES);
+	}
+	failures = setup.failures;
+	for(t = 0; t < nthreads; t++){
+		failures += workers[t].failures;
+	}
+	stress_unmount();
+
+	unlink(".disk");
+	if(chdir("..") == 0){
+		rmdir(scratch);
+	}
+	printf("%s\n", failures ? "FAILED" : "all data checked out after remount");
+	return failures ? 1 : 0;
+}
@@ -14,6 +14,10 @@ See the file COPYING.
 #include <errno.h>
 #include <fcntl.h>
 #include <stdlib.h>
+#include <stdint.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 //size of a disk block
 #define	BLOCK_SIZE 512
@@ -41,6 +45,10 @@ See the file COPYING.
 //beginning of the bitmap
 #define BITMAP_HEAD  (BLOCK_COUNT * BLOCK_SIZE)
 
+//the bitmap is scanned in groups of 64 entries (one cache line)
+#define BITMAP_GROUP 64
+#define BITMAP_GROUPS (BITMAP_SIZE / BITMAP_GROUP)
+
 //How many files can there be in one directory?
 #define MAX_FILES_IN_DIR (BLOCK_SIZE - sizeof(int)) / ((MAX_FILENAME + 1) + (MAX_EXTENSION + 1) + sizeof(size_t) + sizeof(long))
 
@@ -105,6 +113,18 @@ struct Bitmap
 
 typedef struct Bitmap Bitmap;
 
+//The bitmap is read from the disk once and kept here for the rest of the mount.
+//full has a bit for every group of the bitmap with no free entry so the scan
+//can step over the used part of the disk a word at a time, and dirty says
+//which bitmap blocks have to be written back.
+static struct
+{
+	Bitmap map;
+	uint64_t full[(BITMAP_GROUPS + 63) / 64];
+	char dirty[BITMAP_BLOCKS];
+	int loaded;
+} bitmap_cache;
+
 //operation for disk --- function prototypes
 static FILE* open_disk(void);	//open the disk
 static void close_disk(FILE *disk);	//close the disk
@@ -114,6 +134,8 @@ static void* get_block(FILE *f, long block_idx);		//return the whole block
 static void write_block(FILE *disk, int block_idx, void* block);		//update the block
 static long get_free_block(FILE *f);			//return the index to the free blcok
 static void read_bitmap(FILE *disk, Bitmap *bitmap);		//read the bitmap and return
+static void load_bitmap(FILE *disk);		//read the bitmap into bitmap_cache once
+static int flush_bitmap(FILE *disk);		//write back the dirty bitmap blocks
 
 
 //implementations of function prototypes
@@ -173,34 +195,95 @@ if (fread(block, BLOCK_SIZE, 1, file) != 1) {
 return block;
 }
 
-static long get_free_block(FILE *f){
-	int free_blcok_idx = -1;
-	struct Bitmap bitmap;
-
-	//char *bitmap = malloc(BITMAP_SIZE);
-	read_bitmap(f,&bitmap);	//read the bitmap
-
-	//loop through the bitmap and see whether we have free block
+//return the offset of the first free (zero) entry in a group, or -1
+static int group_find_free(const char *group){
 	int i;
-	int found = FALSE;
-	//we loop from 1 because the first block is saved for the root
-	for(i=1; i < BITMAP_SIZE;i++){
-		if(bitmap.bits[i] == 0){
-			//we have a free block
-			found = TRUE;
-			break;
+#ifdef __SSE2__
+	//compare 16 entries at a time against zero
+	const __m128i zero = _mm_setzero_si128();
+	for(i = 0; i < BITMAP_GROUP; i += 16){
+		int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(group + i)), zero));
+		if(mask != 0){
+			return i + __builtin_ctz(mask);
 		}
 	}
+#else
+	//8 entries at a time: the lowest byte flagged here is the first zero byte
+	for(i = 0; i < BITMAP_GROUP; i += 8){
+		uint64_t word;
+		memcpy(&word, group + i, sizeof(word));
+		uint64_t zero = (word - 0x0101010101010101ULL) & ~word & 0x8080808080808080ULL;
+		if(zero != 0){
+			return i + __builtin_ctzll(zero) / 8;
+		}
+	}
+#endif
+	return -1;
+}
 
-	if(!found){
-		free_blcok_idx = -1;		//no free block
+//mark a group full or not full in the summary
+static void summarize_group(long group){
+	uint64_t bit = (uint64_t)1 << (group % 64);
+	if(group_find_free(bitmap_cache.map.bits + group * BITMAP_GROUP) == -1){
+		bitmap_cache.full[group / 64] |= bit;
 	}
 	else{
-		//ready to return the index
-		free_blcok_idx = i;
+		bitmap_cache.full[group / 64] &= ~bit;
+	}
+}
+
+static void load_bitmap(FILE *disk){
+	if(bitmap_cache.loaded){
+		return;
+	}
+	read_bitmap(disk, &bitmap_cache.map);
+	//block 0 is the root and has never been handed out; marking it used
+	//saves the scan from stepping around it
+	bitmap_cache.map.bits[0] = 1;
+	long group;
+	for(group = 0; group < BITMAP_GROUPS; group++){
+		summarize_group(group);
+	}
+	memset(bitmap_cache.dirty, 0, sizeof(bitmap_cache.dirty));
+	bitmap_cache.loaded = TRUE;
+}
 
+static int flush_bitmap(FILE *disk){
+	int i;
+	for(i = 0; i < BITMAP_BLOCKS; i++){
+		if(bitmap_cache.dirty[i]){
+			if(fseek(disk, BITMAP_HEAD + i * BLOCK_SIZE, SEEK_SET) ||
+				fwrite(bitmap_cache.map.bits + i * BLOCK_SIZE, BLOCK_SIZE, 1, disk) != 1){
+				return -1;
+			}
+			bitmap_cache.dirty[i] = 0;
+		}
 	}
-	return free_blcok_idx;
+	return 0;
+}
+
+static long get_free_block(FILE *f){
+	load_bitmap(f);
+
+	//skip over the groups the summary says are full, 64 at a time
+	int i;
+	for(i = 0; i < (int)(sizeof(bitmap_cache.full) / sizeof(uint64_t)); i++){
+		uint64_t open = ~bitmap_cache.full[i];
+		if(open == 0){
+			continue;
+		}
+		long group = i * 64 + __builtin_ctzll(open);
+		if(group >= BITMAP_GROUPS){
+			break;
+		}
+		long free_blcok_idx = group * BITMAP_GROUP + group_find_free(bitmap_cache.map.bits + group * BITMAP_GROUP);
+		//the bitmap's own blocks at the end of the disk are never free
+		if(free_blcok_idx >= BLOCK_COUNT){
+			break;
+		}
+		return free_blcok_idx;
+	}
+	return -1;		//no free block
 }
 
 /*
@@ -213,16 +296,14 @@ static int update_bitmap(FILE *disk, long block_idx, char val){
 		return -1;
 	}
 
-	int success = 0;
-	struct Bitmap bitmap;
-	read_bitmap(disk,&bitmap);	//read the bitmap
-
-	bitmap.bits[block_idx] = val;		//set the bitmap value
+	load_bitmap(disk);
 
-	fseek(disk, BITMAP_HEAD, SEEK_SET);
-	fwrite(&bitmap,sizeof(char),BITMAP_SIZE,disk);
+	bitmap_cache.map.bits[block_idx] = val;		//set the bitmap value
+	summarize_group(block_idx / BITMAP_GROUP);
+	bitmap_cache.dirty[block_idx / BLOCK_SIZE] = 1;
 
-	return success;
+	//only the bitmap block holding this entry goes back to the disk
+	return flush_bitmap(disk);
 
 }
 